@@ -1,8 +1,12 @@
 #include "stdafx.h"
 #include <algorithm>
 #include <iomanip>
+#include <mutex>
+#include <shared_mutex>
 #include <sstream>
+#include <thread>
 #include "nscript3.h"
+#include "ncompiler.h"
 #include "nobjects.h"
 #include "noperators.h"
 
@@ -10,7 +14,7 @@
 #undef max
 
 template<> struct std::less<nscript3::value_t> {
-	bool operator()(const nscript3::value_t &v1, const nscript3::value_t& v2) { return std::visit(nscript3::comparator(), v1, v2) < 0; }
+	bool operator()(const nscript3::value_t &v1, const nscript3::value_t& v2) { return nscript3::visit(nscript3::comparator(), v1, v2) < 0; }
 };
 
 namespace nscript3	{
@@ -26,44 +30,61 @@ const std::error_category& nscript_category()
 std::error_code make_error_code(errc e)				{ return std::error_code(static_cast<int>(e), nscript_category()); }
 std::error_condition make_error_condition(errc e)	{ return std::error_condition(static_cast<int>(e), nscript_category()); }
 
-string_t tm2str(tm tm) {
-	int is_date = !(tm.tm_mday == 1 && tm.tm_mon == 0 && tm.tm_year == 70) ? 1 : 0;
-	int is_time = tm.tm_hour || tm.tm_min || tm.tm_sec ? 1 : 0;
-	int is_sec  = tm.tm_sec ? 1 : 0;
-	char *format[8] = { "", "", "%d:%02d" , "%d:%02d:%02d", "%02d.%02d.%04d", "%02d.%02d.%04d", "%02d.%02d.%04d %d:%02d", "%02d.%02d.%04d %d:%02d:%02d"};
-	char buf[32];
-	sprintf_s(buf, format[ is_date * 4 + is_time * 2 + is_sec ], tm.tm_mday, 1 + tm.tm_mon, 1900 + tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec);
-	return buf;
-}
-
 params_t* to_array_if(const object_ptr& o)
 {
-	if(auto pa = std::dynamic_pointer_cast<v_array>(o); pa)	return &pa->items();
+	if(auto pa = object_cast<v_array>(o); pa)	return &pa->items();
 	return nullptr;
 }
 
 params_t* to_array_if(const value_t& v)
 {
-	if(auto pobj = std::get_if<object_ptr>(&v); pobj)	return to_array_if(*pobj);
+	if(auto pobj = get_if<object_ptr>(&v); pobj)	return to_array_if(*pobj);
 	return nullptr;
 }
 
 array_ptr to_array(const value_t& v)
 {
-	if(auto pobj = std::get_if<object_ptr>(&v); pobj && pobj->get())
-		if(auto parr = std::dynamic_pointer_cast<v_array>(*pobj); parr)	return parr;
-	return is_empty(v) ? std::make_shared<v_array>() 
-					   : std::make_shared<v_array>(std::initializer_list<value_t>{ v });
+	if(auto pobj = get_if<object_ptr>(&v); pobj && pobj->get())
+		if(object_cast<v_array>(*pobj))	return static_pointer_cast<v_array>(*pobj);
+	return is_empty(v) ? make_ref<v_array>() 
+					   : make_ref<v_array>(std::initializer_list<value_t>{ v });
 }
 
 // 'dereference' object. If v holds an ext. object, replace it with the value of object
 value_t& operator *(value_t& v)	{
-	if(auto pobj = std::get_if<object_ptr>(&v); pobj && pobj->get()) {
-		v = (*pobj)->get();
+	if(auto pobj = get_if<object_ptr>(&v); pobj && pobj->get()) {
+		auto obj = pobj->get();
+		switch(obj->kind) {		// built-in kinds are final, their get() is called directly
+		case object_kind::variable:		v = static_cast<variable*>(obj)->value(); break;
+		case object_kind::array:		v = static_cast<v_array*>(obj)->get(); break;
+		case object_kind::array_item:	v = static_cast<v_array::indexer*>(obj)->get(); break;
+		case object_kind::hash_item:	v = static_cast<assoc_array::indexer*>(obj)->get(); break;
+		default:						v = obj->get();
+		}
 	}
 	return v;
 }
 
+value_t i_object::at(const value_t& key)	{ return index(key); }
+
+// Walk values reachable from object, without recursion as data may nest deeply. Shared objects are not entered again
+void i_object::share() const
+{
+	if(!is_local())	return;
+	ref_count::share();
+	std::vector<const i_object*> pending{ this };
+	auto visit = [&](const value_t& v) {
+		auto po = get_if<object_ptr>(&v);
+		if(!po)				v.share();
+		else if(*po && (*po)->is_local())	(*po)->ref_count::share(), pending.push_back(po->get());
+	};
+	while(!pending.empty()) {
+		auto o = pending.back();
+		pending.pop_back();
+		o->parts(visit);
+	}
+}
+
 class context_scope
 {
 	context& _ctx;
@@ -72,27 +93,179 @@ public:
 	~context_scope()						{ _ctx.pop(); }
 };
 
+#pragma region Arena
+
+static constexpr size_t s_chunk_size = 64 * 1024;		// chunks are aligned to their size, to find chunk of a block by address
+static constexpr size_t s_max_block  = 1024;			// larger blocks come from the heap
+static constexpr size_t s_align		 = 16;
+
+// Blocks are bumped from the chunk, blocks freed by the owner thread are reused by size until the whole chunk is free
+struct arena::chunk {
+	static constexpr size_t classes = s_max_block / s_align;
+	std::atomic<pool*>			owner;				// cleared when the owner thread exits
+	size_t						allocated = 0;		// blocks handed out, counted by owner
+	size_t						freed = 0;			// blocks given back by owner
+	size_t						free_bytes = 0;		// size of blocks in free lists
+	std::atomic<ptrdiff_t>		remote = 0;			// blocks freed by other threads; once orphaned, minus blocks still alive
+	char*						top;
+	uint64_t					used;				// free lists holding blocks, bit per size class
+	void*						free[classes];		// blocks freed by owner, by size class
+
+	chunk(pool* owner) : owner(owner)	{ reset(); }
+	char* begin()						{ return reinterpret_cast<char*>(this) + (sizeof(chunk) + s_align - 1) / s_align * s_align; }
+	char* end()							{ return reinterpret_cast<char*>(this) + s_chunk_size; }
+	bool empty() const					{ return allocated == freed + size_t(remote.load(std::memory_order_acquire)); }
+	void reset()						{ allocated = freed = free_bytes = 0; used = 0; remote.store(0, std::memory_order_relaxed); top = begin(); }
+	void* take(size_t size) {
+		void* block = nullptr;
+		if(auto k = size / s_align - 1; used >> k & 1) {
+			block = free[k];
+			if(!(free[k] = *static_cast<void**>(block)))	used &= ~(uint64_t(1) << k);
+			free_bytes -= size;
+		} else if(top + size <= end()) {
+			block = top;
+			top += size;
+		}
+		if(block)	allocated++;
+		return block;
+	}
+	void give(void* block, size_t size) {
+		auto k = size / s_align - 1;
+		*static_cast<void**>(block) = used >> k & 1 ? free[k] : nullptr;
+		free[k] = block;
+		used |= uint64_t(1) << k;
+		free_bytes += size;
+		freed++;
+	}
+
+	static chunk* of(void* block)		{ return reinterpret_cast<chunk*>(uintptr_t(block) & ~uintptr_t(s_chunk_size - 1)); }
+	static chunk* create(pool* owner)	{ return new(::operator new(s_chunk_size, std::align_val_t(s_chunk_size))) chunk(owner); }
+	static void destroy(chunk* c)		{ c->~chunk(); ::operator delete(c, std::align_val_t(s_chunk_size)); }
+	// hand chunk with live blocks over to the threads freeing them, the last one destroys it
+	static void orphan(chunk* c) {
+		c->owner.store(nullptr, std::memory_order_relaxed);
+		auto alive = ptrdiff_t(c->allocated - c->freed);
+		if(c->remote.fetch_sub(alive, std::memory_order_acq_rel) == alive)	destroy(c);
+	}
+};
+
+struct arena::pool {
+	chunk*				current = nullptr;
+	std::vector<chunk*>	retired;		// chunks left with live blocks
+	~pool() {
+		if(current)	chunk::orphan(current);
+		for(auto c : retired)	chunk::orphan(c);
+	}
+	// continue in an empty chunk, or in the one with most free blocks if they are a good part of it. Spare empty chunks go to the heap
+	void* next(size_t size) {
+		if(current)	retired.push_back(current), current = nullptr;
+		chunk* best = nullptr;
+		for(size_t i = 0; i < retired.size(); ) {
+			auto c = retired[i];
+			if(!c->empty()) {
+				if(!best || c->free_bytes > best->free_bytes)	best = c;
+				i++;
+				continue;
+			}
+			if(current)	chunk::destroy(c);
+			else		current = c, c->reset();
+			retired[i] = retired.back(), retired.pop_back();
+		}
+		if(!current && best && best->free_bytes >= s_chunk_size / 4) {
+			if(auto block = best->take(size); block) {
+				*std::find(retired.begin(), retired.end(), best) = retired.back(), retired.pop_back();
+				current = best;
+				return block;
+			}
+		}
+		if(!current)	current = chunk::create(this);
+		return current->take(size);
+	}
+};
+
+thread_local arena::pool* arena::s_pool = nullptr;
+
+arena::pool& arena::local()
+{
+	struct owner_t { ~owner_t() { delete s_pool; s_pool = nullptr; } };
+	static thread_local owner_t owner;		// orphans chunks of the pool when the thread exits
+	if(!s_pool)	s_pool = new pool;
+	return *s_pool;
+}
+
+void* arena::allocate(size_t size)
+{
+	size = (size + s_align - 1) & ~(s_align - 1);
+	if(size > s_max_block)	return ::operator new(size);
+	auto& p = local();
+	if(p.current)
+		if(auto block = p.current->take(size); block)	return block;
+	return p.next(size);
+}
+
+void arena::deallocate(void* block, size_t size) noexcept
+{
+	if(!block)	return;
+	size = (size + s_align - 1) & ~(s_align - 1);
+	if(size > s_max_block)	return ::operator delete(block);
+	auto c = chunk::of(block);
+	if(auto owner = c->owner.load(std::memory_order_relaxed); owner && owner == s_pool) {
+		c->give(block, size);
+		// temporaries of a loop are freed in turn, so the current chunk is started over rather than filled
+		if(c->freed == c->allocated && c == owner->current)	c->reset();
+		return;
+	}
+	if(c->remote.fetch_add(1, std::memory_order_acq_rel) == -1)	chunk::destroy(c);		// last block of orphaned chunk
+}
+
+void arena::rewind() noexcept
+{
+	if(s_pool && s_pool->current && s_pool->current->empty())	s_pool->current->reset();
+}
+
+#pragma endregion
+
 #pragma region Context
-context::vars_t	context::_globals {
+const symbol::entry* symbol::intern(string_view name)
+{
+	struct table_t {
+		std::shared_mutex								lock;
+		std::unordered_map<string_view, const entry*>	entries;		// keys point to names of entries
+	};
+	static auto& table = *new table_t;		// never destroyed, as symbols may be held by other static objects
+	{
+		std::shared_lock read(table.lock);
+		if(auto p = table.entries.find(name); p != table.entries.end())	return p->second;
+	}
+	std::unique_lock write(table.lock);
+	if(auto p = table.entries.find(name); p != table.entries.end())	return p->second;
+	auto e = new entry{ string_t(name), std::hash<string_view>()(name) };
+	table.entries.emplace(e->name, e);
+	return e;
+}
+
+// Globals are seen by all engines and never change, their strings and objects are not counted so threads reading them do not contend
+context::vars_t context::immortal(vars_t&& vars)	{ for(auto& v : vars) v.second.make_immortal(); return std::move(vars); }
+
+const context::vars_t	context::_globals = immortal({
 	{ "empty",	value_t()},
-	{ "hash",	std::make_shared<assoc_array>() },
 	{ "true",	{ true } },
 	{ "false",	{ false } },
 	{ "bool",	make_fn(1, [](const params_t& args) { return to_bool(args.front()); }) },
-	{ "int",	make_fn(1, [](const params_t& args) { return double((int)to_double(args.front())); }) },
+	{ "int",	make_fn(1, [](const params_t& args) { return to_int(args.front()); }) },
 	{ "dbl",	make_fn(1, [](const params_t& args) { return to_double(args.front()); }) },
 	{ "str",	make_fn(1, [](const params_t& args) { return to_string(args.front()); }) },
-	{ "date",	make_fn(1, [](const params_t& args) { return tm2str(to_date(args.front())); }) },
+	{ "date",	make_fn(1, [](const params_t& args) { return to_date(args.front()); }) },
 	// Date
-	{ "now",	make_fn(0, [](const params_t& args) { return tm2str(date2tm(std::chrono::system_clock::now())); }) },
-	{ "day",	make_fn(1, [](const params_t& args) { return double(to_date(args.front()).tm_mday); }) },
-	{ "month",	make_fn(1, [](const params_t& args) { return double(to_date(args.front()).tm_mon + 1); }) },
-	{ "year",	make_fn(1, [](const params_t& args) { return double(to_date(args.front()).tm_year + 1900); }) },
-	{ "hour",	make_fn(1, [](const params_t& args) { return double(to_date(args.front()).tm_hour); }) },
-	{ "minute",	make_fn(1, [](const params_t& args) { return double(to_date(args.front()).tm_min); }) },
-	{ "second",	make_fn(1, [](const params_t& args) { return double(to_date(args.front()).tm_sec); }) },
-	{ "dayofweek",	make_fn(1, [](const params_t& args) { return double(to_date(args.front()).tm_wday); }) },
-	{ "dayofyear",	make_fn(1, [](const params_t& args) { return double(to_date(args.front()).tm_yday + 1); }) },
+	{ "now",	make_fn(0, [](const params_t& args) { return local_now(); }) },
+	{ "day",	make_fn(1, [](const params_t& args) { return int64_t(split_date(to_date(args.front())).day); }) },
+	{ "month",	make_fn(1, [](const params_t& args) { return int64_t(split_date(to_date(args.front())).month); }) },
+	{ "year",	make_fn(1, [](const params_t& args) { return int64_t(split_date(to_date(args.front())).year); }) },
+	{ "hour",	make_fn(1, [](const params_t& args) { return int64_t(split_date(to_date(args.front())).hour); }) },
+	{ "minute",	make_fn(1, [](const params_t& args) { return int64_t(split_date(to_date(args.front())).minute); }) },
+	{ "second",	make_fn(1, [](const params_t& args) { return int64_t(split_date(to_date(args.front())).second); }) },
+	{ "dayofweek",	make_fn(1, [](const params_t& args) { return int64_t(split_date(to_date(args.front())).weekday); }) },
+	{ "dayofyear",	make_fn(1, [](const params_t& args) { return int64_t(split_date(to_date(args.front())).yearday + 1); }) },
 	// Math
 	{ "pi",		make_fn(0, [](const params_t& args) { return 3.14159265358979323846; }) },
 	{ "rnd",	make_fn(0, [](const params_t& args) { return (double)rand() / (double)RAND_MAX; }) },
@@ -107,65 +280,98 @@ context::vars_t	context::_globals {
 	{ "sqrt",	make_fn(1, [](const params_t& args) { return sqrt(to_double(args.front())); }) },
 	{ "atan2",	make_fn(2, [](const params_t& args) { auto x = to_double(args[0]), y = to_double(args[1]); return atan2(x, y); }) },
 	{ "sgn",	make_fn(1, [](const params_t& args) { double d = to_double(args.front()); return d < 0 ? -1. : d > 0 ? 1. : 0.; }) },
-	{ "fract",	make_fn(1, [](const params_t& args) { auto d = to_double(args.front()); return d - (int)d; }) },
+	{ "fract",	make_fn(1, [](const params_t& args) { auto d = to_double(args.front()); return d - std::trunc(d); }) },
 	// String
 	{ "chr",	make_fn(1, [](const params_t& args) { return string_t(1, (string_t::value_type)to_double(args.front()) ); }) },
-	{ "asc",	make_fn(1, [](const params_t& args) { return (double)to_string(args.front()).c_str()[0]; }) },
-	{ "len",	make_fn(1, [](const params_t& args) { return (double)to_string(args.front()).size(); }) },
-	{ "left",	make_fn(2, [](const params_t& args) { return to_string(args[0]).substr(0, (int)to_double(args[1])); }) },
-	{ "right",	make_fn(2, [](const params_t& args) { auto s = to_string(args[0]); auto n = (int)to_double(args[1]); return s.substr(s.size() - n, n); }) },
-	{ "mid",	make_fn(3, [](const params_t& args) { return to_string(args[0]).substr((int)to_double(args[1]), (int)to_double(args[2])); }) },
+	{ "asc",	make_fn(1, [](const params_t& args) { return int64_t(to_string(args.front()).c_str()[0]); }) },
+	{ "len",	make_fn(1, [](const params_t& args) { return int64_t(to_string(args.front()).size()); }) },
+	{ "left",	make_fn(2, [](const params_t& args) { return to_string(args[0]).substr(0, to_int(args[1])); }) },
+	{ "right",	make_fn(2, [](const params_t& args) { auto s = to_string(args[0]); auto n = to_int(args[1]); return s.substr(s.size() - n, n); }) },
+	{ "mid",	make_fn(3, [](const params_t& args) { return to_string(args[0]).substr(to_int(args[1]), to_int(args[2])); }) },
 	{ "upper",	make_fn(1, [](const params_t& args) { auto s = to_string(args[0]); return std::transform(s.begin(), s.end(), s.begin(), ::toupper), s; }) },
 	{ "lower",	make_fn(1, [](const params_t& args) { auto s = to_string(args[0]); return std::transform(s.begin(), s.end(), s.begin(), ::tolower), s; }) },
-	{ "string",	make_fn(2, [](const params_t& args) { return string_t((int)to_double(args[0]), *to_string(args[1]).c_str()); }) },
+	{ "string",	make_fn(2, [](const params_t& args) { return string_t(to_int(args[0]), *to_string(args[1]).c_str()); }) },
 	{ "replace",make_fn(3, [](const params_t& args) { 
 		string_t s(to_string(args[0])), from(to_string(args[1])), to(to_string(args[2]));
 		for(string_t::size_type p = 0; (p = s.find(from, p)) != string_t::npos; p += to.size())	s.replace(p, from.size(), to);
 		return s;
 	}) },
-	{ "instr",	make_fn(2, [](const params_t& args) { return (double)(int)to_string(args[0]).find(to_string(args[1])); }) },
+	{ "instr",	make_fn(2, [](const params_t& args) { return int64_t(to_string(args[0]).find(to_string(args[1]))); }) },
 	//{ "format",	make_fn(1, [](const params_t& args) { std::stringstream str; str << std::hex << to_int(argv[0]); return str.str(); }) },
-	{ "hex",	make_fn(1, [](const params_t& args) { std::stringstream str; str << std::hex << (int)to_double(args.front()); return str.str(); }) },
+	{ "hex",	make_fn(1, [](const params_t& args) { std::stringstream str; str << std::hex << to_int(args.front()); return str.str(); }) },
 	{ "rgb",	make_fn(3, [](const params_t& args) { return to_double(args[2]) * 65536 + to_double(args[1]) * 256 + to_double(args[0]); }) },
 	// Array
-	{ "size",	make_fn(-1, [](const params_t& args){ return (double)args.size(); }) },
+	{ "size",	make_fn(-1, [](const params_t& args){ return int64_t(args.size()); }) },
 	{ "add",	make_fn(2, [](const params_t& args) { auto a = to_array(args[0]); return a->items().push_back(args[1]), a; }) },
-	{ "remove",	make_fn(2, [](const params_t& args) { auto a = to_array(args[0]); return a->items().erase( a->items().begin() + (int)to_double(args[1])), a; }) },
+	{ "remove",	make_fn(2, [](const params_t& args) { auto a = to_array(args[0]); return a->items().erase( a->items().begin() + to_int(args[1])), a; }) },
 	{ "min",	make_fn(-1, [](const params_t& args) { auto pe = std::min_element(begin(args), end(args), std::less<nscript3::value_t>()); return pe == end(args) ? value_t{} : *pe; }) },
 	{ "max",	make_fn(-1, [](const params_t& args) { auto pe = std::max_element(begin(args), end(args), std::less<nscript3::value_t>()); return pe == end(args) ? value_t{} : *pe; }) },
-	{ "fold",	make_fn(1, [](const params_t& args) { return std::make_shared<fold_function>(std::get<object_ptr>(args[0])); }) },
-	{ "map",	make_fn(1, [](const params_t& args) { return std::make_shared<map_function>(std::get<object_ptr>(args[0])); }) },
-	{ "filter",	make_fn(1, [](const params_t& args) { return std::make_shared<filter_function>(std::get<object_ptr>(args[0])); }) },
+	{ "fold",	make_fn(1, [](const params_t& args) { return make_ref<fold_function>(nscript3::get<object_ptr>(args[0])); }) },
+	{ "map",	make_fn(1, [](const params_t& args) { return make_ref<map_function>(nscript3::get<object_ptr>(args[0])); }) },
+	{ "filter",	make_fn(1, [](const params_t& args) { return make_ref<filter_function>(nscript3::get<object_ptr>(args[0])); }) },
 	{ "head",	make_fn(-1, [](const params_t& args) { return args.empty() ? value_t{} : args.front(); }) },
-	{ "tail",	make_fn(-1, [](const params_t& args) { return args.empty() ? value_t{} : std::make_shared<v_array>(args.begin() + 1, args.end()); }) },
-};
+	{ "tail",	make_fn(-1, [](const params_t& args) { return args.empty() ? value_t{} : make_ref<v_array>(args.begin() + 1, args.end()); }) },
+});
 
 context::context(const context *base, const var_names *vars) : _locals(1)
 {
 	if(base) {
 		if(vars)	{ for(auto& v : *vars) if(auto o = base->get(v); o)	set(v, o.value()); }
-		else		_locals.assign(base->_locals.begin(), base->_locals.end());
+		else		_locals.assign(base->_locals.begin(), base->_locals.end()), _depth = base->_depth;
+	} else {
+		static const symbol hash("hash");
+		set(hash, make_ref<assoc_array>());		// the only mutable built-in, each engine has its own so engines share no state
 	}
 }
 
-value_t& context::get(string_t name, bool local)
+// Find variable or create it in innermost scope, level receives depth of its scope (0 for globals)
+const value_t& context::get(symbol name, lookup mode, size_t* level)
 {
-	if(!local)	{
-		for(int i = (int)_locals.size() - 1; i >= -1; i--)	{
-			vars_t& plane = i < 0 ? _globals : _locals[i];
-			if(auto p = plane.find(name); p != plane.end()) return	p->second;
+	if(mode != lookup::local)	{
+		for(auto ri = _locals.rbegin(); ri != _locals.rend(); ri++)	{
+			if(auto p = ri->vars.find(name); p != ri->vars.end()) {
+				if(level)	*level = ri->depth;
+				return	p->second;
+			}
+		}
+		if(auto p = _globals.find(name); p != _globals.end() && mode == lookup::read) {
+			if(level)	*level = 0;
+			return p->second;
 		}
 	}
-	return _locals.back()[name] = std::make_shared<variable>();
+	if(level)	*level = _depth;
+	if(_locals.back().depth != _depth)	_locals.push_back({ _depth });
+	return _locals.back().vars[name] = make_ref<variable>();
 }
 
-std::optional<value_t> context::get(string_t name) const
+std::optional<value_t> context::get(symbol name) const
 {
 	for(auto ri = _locals.rbegin(); ri != _locals.rend(); ri++)	{
-		if(auto p = ri->find(name);  p != ri->end())	return { p->second };
+		if(auto p = ri->vars.find(name);  p != ri->vars.end())	return { p->second };
 	}
 	return {};
 }
+
+context::snapshot context::save() const
+{
+	auto& vars = _locals.front().vars;
+	return snapshot(vars.begin(), vars.end());
+}
+
+// Put back variables of the outermost scope, writing only those changed since they were saved
+void context::restore(const snapshot& saved)
+{
+	auto& vars = _locals.front().vars;
+	for(auto& [name, value] : saved) {
+		if(auto p = vars.find(name); p == vars.end())	vars.emplace(name, value);
+		else if(p->second != value)						p->second = value;
+	}
+	if(vars.size() == saved.size())	return;
+	for(auto p = vars.begin(); p != vars.end(); ) {
+		if(std::any_of(saved.begin(), saved.end(), [&](auto& v) { return v.first == p->first; }))	p++;
+		else	p = vars.erase(p);
+	}
+}
 #pragma endregion
 
 #pragma region Nscript
@@ -187,36 +393,209 @@ static auto s_operators = std::make_tuple(
 	std::tuple<op_xpp, op_xmm, op_call, op_index, op_item, op_tail>()
 );
 
-std::tuple<bool, value_t> nscript::eval(std::string_view script)
+// Run action, converting exceptions to error result
+template <class F> std::tuple<bool, value_t> nscript::protect(F action)
 {
-	value_t result;
+	struct rewind_t { ~rewind_t() { arena::rewind(); } } rewind;		// temporaries of the evaluation are gone by then
 	_last_error.clear();
+	try	{
+		return { true, action() };
+	}
+	catch(std::system_error& se){ _last_error = se.code();  return { false, string_t(se.what()) }; }
+	catch(std::exception& e)	{ _last_error = errc::runtime_error; return { false, string_t(e.what()) }; }
+	catch(...)					{ _last_error = errc::runtime_error; return { false, {} }; }
+}
+
+// Run compiled code in a new scope, pointing parser to the failed instruction on error
+value_t nscript::execute(const code& code, const string_t* source)
+{
 	context_scope scope(_context);
+	vm machine(_context);
+	value_t result;
 	try	{
+		result = machine.run(code.rebinds(_context) ? *code.unfolded : code);
+	}
+	catch(...)	{
+		if(source)	_parser.init(*source);
+		_parser.set_state(machine.position());
+		throw;
+	}
+	return *result;
+}
+
+std::tuple<bool, value_t> nscript::eval(std::string_view script)
+{
+	return protect([&] {
 		_parser.init(script);
+		if(_backend != backend::interpreter)	return execute(*compiler(_parser, _options, _backend).compile());
+		value_t result;
+		context_scope scope(_context);
 		parse<Script>(result, false);
 		if(_parser.get_token() != parser::end)	throw std::system_error(errc::syntax_error, "eval");
-		*result;
+		return *result;
+	});
+}
+
+std::tuple<bool, value_t> nscript::eval(const compiled_script& script)
+{
+	return protect([&] {
+		if(!script)	throw std::system_error(std::make_error_code(std::errc::invalid_argument), "eval");
+		return execute(*script._code, script._source.get());
+	});
+}
+
+// Whether rows of a batch may store to hash of the engine, from the script itself or from functions reachable from variables and inputs
+static bool uses_hash(const code& code, const context::snapshot& vars, const column_refs& inputs)
+{
+	static const symbol hash("hash");
+	if(code.captures.count(hash))	return true;
+	auto ph = std::find_if(vars.begin(), vars.end(), [](auto& var) { return var.first == hash; });
+	auto target = ph != vars.end() ? get_if<object_ptr>(&ph->second) : nullptr;
+	if(!target || !*target)	return false;
+	// walk objects as share() does, each once
+	std::unordered_set<const i_object*> seen;
+	std::vector<const i_object*> pending;
+	auto visit = [&](const value_t& v) {
+		if(auto po = get_if<object_ptr>(&v); po && *po && seen.insert(po->get()).second)	pending.push_back(po->get());
+	};
+	for(auto& var : vars)	if(var.first != hash)	visit(var.second);
+	for(auto& input : inputs)
+		if(auto values = std::get_if<std::vector<value_t>>(input.second); values)	for(auto& v : *values)	visit(v);
+	while(!pending.empty()) {
+		auto o = pending.back();
+		pending.pop_back();
+		if(o == target->get())	return true;
+		o->parts(visit);
 	}
-	catch(std::system_error& se){ _last_error = se.code();  return { false, string_t(se.what()) }; }
-	catch(std::exception& e)	{ _last_error = errc::runtime_error; return { false, string_t(e.what()) }; }
-	catch(...)					{ _last_error = errc::runtime_error; return { false, {} }; }
-	return { true, result };
+	return false;
+}
+
+// Evaluate compiled script for every row, with input columns bound to variables of their names, converting results to type of out column.
+// Rows are split among threads unless the script or functions it may call use hash. Other threads run engines with variables of this one,
+// which are shared first with everything reachable from them
+std::tuple<bool, value_t> nscript::eval_batch(const compiled_script& script, const column_refs& inputs, column& out, unsigned threads)
+{
+	static const symbol hash("hash");
+	return protect([&] {
+		auto size = [](const column* c) { return std::visit([](auto& values) { return values.size(); }, *c); };
+		if(!script || inputs.empty())	throw std::system_error(std::make_error_code(std::errc::invalid_argument), "eval_batch");
+		auto rows = size(inputs.front().second);
+		for(auto& input : inputs)
+			if(size(input.second) != rows)	throw std::system_error(std::make_error_code(std::errc::invalid_argument), "eval_batch");
+		std::visit([&](auto& values) { values.assign(rows, typename std::decay_t<decltype(values)>::value_type{}); }, out);
+
+		// parts of whole 64-row blocks, so threads storing booleans write different words
+		size_t blocks = (rows + 63) / 64, parts = std::max<size_t>(1, std::min<size_t>(threads, blocks));
+		auto saved = _context.save();
+		if(parts > 1 && uses_hash(*script._code, saved, inputs))	parts = 1;		// rows may read what earlier rows stored to hash, so they run in order
+		auto part = (blocks + parts - 1) / parts * 64;
+		if(parts > 1) {
+			for(auto& var : saved)	var.second.share();
+			for(auto& input : inputs)
+				if(auto values = std::get_if<std::vector<value_t>>(input.second); values)	for(auto& v : *values)	v.share();
+		}
+		std::atomic<bool> failed = false;
+		std::vector<std::pair<std::exception_ptr, parser::state>> errors(parts);
+		{
+			struct workers_t : std::vector<std::thread> { ~workers_t() { for(auto& t : *this) t.join(); } } workers;
+			for(size_t i = 1; i < parts; i++)
+				workers.emplace_back([&, i] {
+					nscript engine;
+					for(auto& [name, value] : saved)	if(name != hash) engine.add(name, value);
+					try	{
+						engine.eval_rows(script, inputs, out, i * part, std::min(rows, (i + 1) * part), failed);
+					}
+					catch(...)	{ errors[i] = { std::current_exception(), engine._parser.get_state() }; failed = true; }
+				});
+			try	{
+				eval_rows(script, inputs, out, 0, std::min(rows, part), failed);
+			}
+			catch(...)	{ errors[0] = { std::current_exception(), _parser.get_state() }; failed = true; }
+		}
+		_context.restore(saved);
+		// error of the first failed part, other parts stop without one
+		for(auto& [error, state] : errors) {
+			if(!error)	continue;
+			_parser.init(*script._source);
+			_parser.set_state(state);
+			std::rethrow_exception(error);
+		}
+		return value_t(int64_t(rows));
+	});
+}
+
+// Evaluate rows [begin, end) of batch, stopping when another thread fails
+void nscript::eval_rows(const compiled_script& script, const column_refs& inputs, column& out, size_t begin, size_t end, const std::atomic<bool>& failed)
+{
+	std::vector<value_t*> vars;				// bound once, only values are stored for each row
+	for(auto& input : inputs)	vars.push_back(&_context.set(input.first, {}));
+	for(auto row = begin; row < end && !failed.load(std::memory_order_relaxed); row++) {
+		for(size_t i = 0; i < inputs.size(); i++)
+			*vars[i] = std::visit([&](auto& values) { return value_t(values[row]); }, *inputs[i].second);
+		auto result = execute(*script._code, script._source.get());
+		std::visit([&](auto& values) {
+			using T = typename std::decay_t<decltype(values)>::value_type;
+			if constexpr(std::is_same_v<T, value_t>)		values[row] = std::move(result);
+			else if constexpr(std::is_same_v<T, bool>)		values[row] = to_bool(result);
+			else if constexpr(std::is_same_v<T, double>)	values[row] = to_double(result);
+			else if constexpr(std::is_same_v<T, int64_t>)	values[row] = to_int(result);
+			else if constexpr(std::is_same_v<T, date_t>)	values[row] = to_date(result);
+			else											values[row] = to_string(result);
+		}, out);
+		arena::rewind();
+	}
+}
+
+// Return engine to variables added before mark(), with an empty hash
+void nscript::mark()
+{
+	static const symbol hash("hash");
+	_marked = _context.save();
+	auto o = get_if<object_ptr>(&_context.get(hash));
+	auto a = o ? object_cast<assoc_array>(*o) : nullptr;
+	_marked_hash = a ? make_ref<assoc_array>(*a) : nullptr;
+}
+
+// Hash is given a new copy of marked items only if evaluations changed it
+void nscript::reset()
+{
+	static const symbol hash("hash");
+	_last_error.clear();
+	if(_marked)	_context.restore(*_marked);
+	auto marked = object_cast<assoc_array>(_marked_hash);
+	auto o = get_if<object_ptr>(&_context.get(hash));
+	if(auto a = o ? object_cast<assoc_array>(*o) : nullptr; a && (marked ? a->items() == marked->items() : a->items().empty()))	return;
+	// a new one, as indexers of values escaping the evaluation may point into the old one
+	auto& fresh = _context.set(hash, marked ? make_ref<assoc_array>(*marked) : make_ref<assoc_array>());
+	if(_marked)
+		for(auto& var : *_marked)	if(var.first == hash)	var.second = fresh;
+}
+
+// Compile script once to evaluate it many times, possibly by different nscript instances
+compiled_script nscript::compile(std::string_view script)
+{
+	compiled_script compiled;
+	protect([&] {
+		_parser.init(script);
+		compiled = compiled_script(compiler(_parser, _options, _backend).compile(), script);
+		return value_t{};
+	});
+	return compiled;
 }
 
 // Parse comma-separated arguments list
-void nscript::parse_args(args_list& args) {
-	auto token = _parser.next();
-	if(token == parser::lpar)	_parser.next();
+void nscript::parse_args(parser& parser, args_list& args) {
+	auto token = parser.next();
+	if(token == parser::lpar)	parser.next();
 
-	while(_parser.get_token() == parser::name) {
-		args.push_back(_parser.get_name());
-		if(_parser.next() != parser::comma) break;
-		_parser.next();
+	while(parser.get_token() == parser::name) {
+		args.push_back(parser.get_name());
+		if(parser.next() != parser::comma) break;
+		parser.next();
 	};
 	if(args.size() == 1 && args.front() == "@")	args.clear();
 
-	if(_parser.get_token() == parser::rpar)	_parser.next();
+	if(parser.get_token() == parser::rpar)	parser.next();
 }
 
 // Jump to position <state>, parse expression and return back
@@ -228,7 +607,7 @@ template <nscript::Precedence P> void nscript::parse(parser::state state, value_
 	_parser.set_state(current);
 }
 
-template <nscript::Precedence P, class OP> bool nscript::apply_op(OP op, value_t& result, bool skip)
+template <nscript::Precedence P, class OP> bool nscript::apply_op(OP op, value_t& result, bool skip, parser::state start)
 {
 	if(op.token == _parser.get_token()) {
 		if(op.token != parser::lpar && op.token != parser::lsquare && op.token != parser::dot)	_parser.next();
@@ -239,15 +618,35 @@ template <nscript::Precedence P, class OP> bool nscript::apply_op(OP op, value_t
 
 		value_t right = result;
 
+		// '&&' and '||' skip right-hand operand when the left one decides the result
+		bool decided = false;
+		if(!skip && (op.token == parser::land || op.token == parser::lor)) {
+			value_t left = result;
+			auto pb = get_if<bool>(&*left);
+			decided = pb && *pb == (op.token == parser::lor);
+		}
+
 		// parse right-hand operand
-		if(op.token == parser::dot) { right = _parser.get_name(); _parser.next(); }		// special case for '.' operator
-		else if(op.assoc == associativity::right)	parse<P>(right, skip);				// right-associative operators
-		else if(op.assoc == associativity::left)	parse<P+1>(right, skip);			// left-associative operators
+		if(op.token == parser::dot) {							// special case for '.' operator
+			auto name = _parser.get_name();
+			_parser.next();
+			if(!skip)	op_item::apply(result, name);
+			return true;
+		}
+		if(op.assoc == associativity::right)	parse<P>(right, skip || decided);			// right-associative operators
+		else if(op.assoc == associativity::left)	parse<P+1>(right, skip || decided);			// left-associative operators
 
+		if(skip)	return true;
 		if(op.deref == dereference::left  || op.deref == dereference::both)	*result;
 		if(op.deref == dereference::right || op.deref == dereference::both)	*right;
 
-		if(!skip)	result = std::visit(op, result, right);								// perform operator's action
+		if constexpr(std::is_same_v<OP, op_index>) {		// element is read in place, indexer is made only to assign to it
+			if(!_parser.is_target(start)) {
+				if(!op_at::forward(result, right))	result = visit(op_at(), result, right);
+				return true;
+			}
+		}
+		if(!decided && !op.forward(result, right))	result = visit(op, result, right);		// perform operator's action
 		return true;
 	}
 	return false;
@@ -258,35 +657,41 @@ template <nscript::Precedence P> void nscript::parse(value_t& result, bool skip)
 {
 	// main parse loop
 	parser::token token = _parser.get_token();
+	if(skip && _parser.skip(P))	return;			// region was skipped before
+	auto start = _parser.get_state();
 
 	// parse left-hand operand (for binary operators)
 	parse<Precedence(P + 1)>(result, skip);
-	if(_parser.get_token() == parser::end)	return;
-	while(std::apply([&](auto ...op) { return (apply_op<P, decltype(op)>(op, result, skip) || ...); }, std::get<P>(s_operators)));
+	if(_parser.get_token() != parser::end)
+		while(std::apply([&](auto ...op) { return (apply_op<P, decltype(op)>(op, result, skip, start) || ...); }, std::get<P>(s_operators)));
+	if(skip)	_parser.skipped(start, P);
 }
 
 template<> void nscript::parse<nscript::Unary>(value_t& result, bool skip)
 {
 	parser::token token = _parser.get_token();
 	if(_parser.get_token() == parser::end)	return;
-	if(!std::apply([&](auto ...op) { return (apply_op<nscript::Unary, decltype(op)>(op, result, skip) || ...); }, std::get<nscript::Unary>(s_operators)))
+	if(!std::apply([&](auto ...op) { return (apply_op<nscript::Unary, decltype(op)>(op, result, skip, _parser.get_state()) || ...); }, std::get<nscript::Unary>(s_operators)))
 		parse<nscript::Functional>(result, skip);
 }
 
 template<> void nscript::parse<nscript::Statement>(value_t& result, bool skip)
 {
 	parser::token token = _parser.get_token();
+	if(skip && _parser.skip(Statement))	return;
+	auto start = _parser.get_state();
 	parse<Assignment>(result, skip);
 	if(_parser.get_token() == parser::comma) {
-		auto a = std::make_shared<v_array>(std::initializer_list<value_t>{*result});
+		auto a = skip ? nullptr : make_ref<v_array>(std::initializer_list<value_t>{*result});
 		do {
 			value_t v;
 			_parser.next();
 			parse<Assignment>(v, skip);
-			a->items().push_back(*v);
+			if(!skip)	a->items().push_back(*v);
 		} while(_parser.get_token() == parser::comma);
-		result = a;
+		if(!skip)	result = a;
 	}
+	if(skip)	_parser.skipped(start, Statement);
 }
 
 template<> void nscript::parse<nscript::Primary>(value_t& result, bool skip)
@@ -299,11 +704,13 @@ template<> void nscript::parse<nscript::Primary>(value_t& result, bool skip)
 		if(_parser.next() != parser::name)	throw std::system_error(errc::syntax_error, "'my'");
 		local = true;
 		[[fallthrough]];
-	case parser::name:
-		if(skip)	_varnames.insert(_parser.get_name());
-		else		result = _context.get(_parser.get_name(), local);
+	case parser::name:	{
+		auto start = _parser.get_state();
+		auto var = _parser.get_name();
 		_parser.next();
+		if(!skip)	result = _context.get(var, local ? context::lookup::local : _parser.is_target(start) ? context::lookup::assign : context::lookup::read);
 		break;
+	}
 	case parser::iffunc:	_parser.next(); parse<Assignment>(result, skip); parse_if<Assignment>(result, skip); break;
 	case parser::lambda:
 	case parser::func:		parse_func(result, skip); break;
@@ -373,31 +780,705 @@ void nscript::parse_for(value_t& result, bool skip) {
 	}
 }
 
+// Function body is compiled once, when literal is parsed
 void nscript::parse_func(value_t& result, bool skip)
 {
-	args_list args;
-	parse_args(args);
-	parser::state state = _parser.get_state();
-	if(_parser.get_token() == parser::end)	throw std::system_error(errc::syntax_error, "'fn'");
-	// _varnames contains list of variables to be captured by function
-	if(!skip)	_varnames.clear();
-	parse<Assignment>(result, true);
-	if(!skip)	result = std::make_shared<user_function>(args, _parser.get_content(state, _parser.get_state()), &_context, &_varnames);
+	auto body = compiler(_parser, _options).compile_function();
+	if(body->rebinds(_context))	body = body->unfolded;
+	if(!skip)	result = make_ref<user_function>(body, &_context);
 }
 
 // Parse "object [(<arguments>)] {<body>}" statement
 void nscript::parse_obj(value_t& result, bool skip)
+{
+	auto body = compiler(_parser, _options).compile_object();
+	if(body->rebinds(_context))	body = body->unfolded;
+	if(!skip)	result = make_ref<user_class>(body, &_context);
+}
+
+#pragma endregion
+
+#pragma region Compiler
+
+// Perform operator's action on registers, dereferencing operands as the interpreter does
+template<class OP> void apply_operator(value_t& result, value_t& right)
+{
+	OP op;
+	if(op.deref == dereference::left  || op.deref == dereference::both)	*result;
+	if(op.deref == dereference::right || op.deref == dereference::both)	*right;
+	if(!op.forward(result, right))	result = visit(op, result, right);
+}
+
+// Operators without side effects, applied to constants at compile time
+template<class OP, class ...OPS> constexpr bool is_one_of = (std::is_same_v<OP, OPS> || ...);
+template<class OP> constexpr bool is_pure = is_one_of<OP, op_statmt, op_land, op_lor, op_and, op_or, op_eq, op_ne, op_gt, op_ge, op_lt, op_le,
+	op_add, op_sub, op_mul, op_div, op_mod, op_pow, op_neg, op_not, op_lnot, op_call>;
+
+// Built-in constants and functions without side effects, their calls with constant arguments are folded
+static const std::unordered_set<symbol, symbol::hash> s_pure_globals = {
+	"empty", "true", "false", "bool", "int", "dbl", "str", "date", "day", "month", "year", "hour", "minute", "second", "dayofweek", "dayofyear",
+	"pi", "sin", "cos", "tan", "atan", "abs", "exp", "log", "sqr", "sqrt", "atan2", "sgn", "fract",
+	"chr", "asc", "len", "left", "right", "mid", "upper", "lower", "string", "replace", "instr", "hex", "rgb", "size", "min", "max", "head",
+};
+
+// Compile body, and once more without folding if folding assumed values of built-ins, which host may bind to other values
+code_ptr compiler::compile(body_fn body)
+{
+	auto start = _parser.get_state();
+	auto folded = (this->*body)();
+	if(_assumed.empty())	return folded;
+	_parser.set_state(start);
+	compiler plain(_parser, { false }, _backend);
+	folded->unfolded = (plain.*body)();
+	folded->assumed = std::move(_assumed);
+	return folded;
+}
+
+std::shared_ptr<code> compiler::script_body()
+{
+	auto script = std::make_shared<code>();
+	_code = script.get();
+	_label = 0;
+	_known.clear();
+	compile<nscript::Script>(0);
+	if(_parser.get_token() != parser::end)	throw std::system_error(errc::syntax_error, "eval");
+	if(_backend == backend::closure)	bind(*script);
+	return script;
+}
+
+size_t compiler::emit(opcode op, unsigned a, unsigned b, apply_fn fn, size_t pos)
+{
+	auto& program = _code->program;
+	bool store = op == opcode::nil || op == opcode::loadk || op == opcode::load || op == opcode::loadmy || op == opcode::loadset ||
+				 op == opcode::func || op == opcode::object || ((op == opcode::move || op == opcode::array) && a != b);
+	// previous store to the same register is dead, unless a jump lands right after it
+	if(store && _label < program.size()) {
+		auto& last = program.back();
+		if((last.op == opcode::nil || last.op == opcode::loadk || last.op == opcode::move) && last.a == a) {
+			program.pop_back();
+			_code->positions.pop_back();
+		}
+	}
+	program.push_back({ op, a, b, fn });
+	_code->positions.push_back(pos == npos ? _parser.get_state() : pos);
+	track(program.back());
+	if(op != opcode::jump && op != opcode::push && op != opcode::pop)	_code->registers = std::max(_code->registers, a + 1);
+	if(op == opcode::move || op == opcode::apply || op == opcode::array || op == opcode::append)	_code->registers = std::max(_code->registers, b + 1);
+	return program.size() - 1;
+}
+
+unsigned compiler::constant(value_t value)
+{
+	value.share();		// compiled code may be run by several engines at once
+	_code->constants.push_back(value);
+	return unsigned(_code->constants.size() - 1);
+}
+
+unsigned compiler::name(symbol name)
+{
+	_code->captures.insert(name);
+	auto p = std::find(_code->names.begin(), _code->names.end(), name);
+	if(p == _code->names.end())	p = _code->names.insert(p, name);
+	return unsigned(p - _code->names.begin());
+}
+
+unsigned compiler::member(symbol name)
+{
+	_code->members.emplace_back(name);
+	return unsigned(_code->members.size() - 1);
+}
+
+// Constant value of register, if it is known at current point of the code
+const compiler::known_value* compiler::known(unsigned r) const
+{
+	if(r >= _known.size() || !_known[r] || _known[r]->start < _label)	return nullptr;
+	return &_known[r].value();
+}
+
+// Follow constants through the instruction just emitted
+void compiler::track(const instruction& i)
+{
+	if(is_jump(i.op) || i.op == opcode::push || i.op == opcode::pop)	return;
+	if(_known.size() <= i.a)	_known.resize(i.a + 1);
+	auto at = _code->program.size() - 1;
+	auto src = known(i.b);
+	switch(i.op) {
+	case opcode::nil:		_known[i.a] = known_value{ value_t{}, at }; break;
+	case opcode::loadk:		_known[i.a] = known_value{ _code->constants[i.b], at }; break;
+	case opcode::move:		if(i.a != i.b)	_known[i.a] = src ? std::optional<known_value>(*src) : std::nullopt; break;
+	case opcode::array:
+		if(src)	_known[i.a] = known_value{ make_ref<v_array>(std::initializer_list<value_t>{ src->value }), src->start };
+		else	_known[i.a].reset();
+		break;
+	case opcode::append:
+		if(auto dst = known(i.a); dst && src)	to_array_if(dst->value)->push_back(src->value);
+		else	_known[i.a].reset();
+		break;
+	default:				_known[i.a].reset(); break;
+	}
+}
+
+// Drop code emitted since given position
+void compiler::discard(size_t from)
+{
+	_code->program.resize(from);
+	_code->positions.resize(from);
+	for(auto& k : _known)	if(k && k->start >= from)	k.reset();
+}
+
+// Replace operator applied to constants by its result
+bool compiler::fold(unsigned a, unsigned b, apply_fn fn, bool unary, size_t pos)
+{
+	auto x = known(a), y = known(b);
+	if(!_options.fold || !y || !(x || unary))	return false;
+	// operands must be computed by consecutive instructions without side effects
+	auto start = unary ? y->start : std::min(x->start, y->start);
+	for(auto i = start; i < _code->program.size(); i++) {
+		auto& in = _code->program[i];
+		bool pure = in.op == opcode::nil || in.op == opcode::loadk || in.op == opcode::move || in.op == opcode::array || in.op == opcode::append ||
+					(in.op == opcode::load && s_pure_globals.count(_code->names[in.b]) && !_shadowed.count(_code->names[in.b]));
+		if(!pure || in.a < a)	return false;
+	}
+	value_t result = x ? x->value : value_t{}, right = y->value;
+	try	{
+		fn(result, right);
+	}
+	catch(...)	{ return false; }		// leave errors to runtime
+	if(auto po = get_if<object_ptr>(&result); po && *po)	return false;
+
+	pos = std::min(pos, _code->positions[start]);
+	dump(pos, to_string(result));
+	assume(start);
+	discard(start);
+	emit(opcode::loadk, a, constant(result), nullptr, pos);
+	return true;
+}
+
+// Built-ins loaded by code from given instruction on are taken for constants
+void compiler::assume(size_t from)
+{
+	for(auto i = from; i < _code->program.size(); i++)
+		if(_code->program[i].op == opcode::load)	_assumed.insert(_code->names[_code->program[i].b]);
+}
+
+// Whether context binds a name the folding took for a built-in
+bool code::rebinds(const context& ctx) const
+{
+	return std::any_of(assumed.begin(), assumed.end(), [&](const symbol& name) { return ctx.get(name).has_value(); });
+}
+
+void compiler::dump(size_t from, string_view result)
+{
+	if(!_options.dump)	return;
+	auto text = _parser.get_content(from, _parser.get_state());
+	text.erase(0, text.find_first_not_of(" \t\r\n"));
+	*_options.dump << text << " => " << result << std::endl;
+}
+
+template <nscript::Precedence P, class OP> bool compiler::compile_op(OP op, unsigned r, parser::state start)
+{
+	if(op.token != _parser.get_token())	return false;
+	auto pos = _parser.get_state();
+	if(op.token != parser::lpar && op.token != parser::lsquare && op.token != parser::dot)	_parser.next();
+	if(op.token == parser::ifop) {		// ternary "a?b:c" operator
+		compile_if<nscript::Logical>(r);
+		return true;
+	}
+
+	if(op.token == parser::dot) {		// member access with its own inline cache
+		emit(opcode::item, r, member(_parser.get_name()), nullptr, pos);
+		_parser.next();
+		return true;
+	}
+
+	// '&&' and '||' skip right-hand operand when the left one decides the result
+	size_t skip = npos;
+	if(op.token == parser::land || op.token == parser::lor) {
+		bool decisive = op.token == parser::lor;
+		auto left = _options.fold ? known(r) : nullptr;
+		if(!left)	skip = emit(op.token == parser::land ? opcode::land : opcode::lor, r);
+		else {
+			assume(left->start);
+			if(auto pb = get_if<bool>(&left->value); pb && *pb == decisive) {
+				compile_branch<Precedence(P + 1)>(r + 1, false);
+				return true;
+			}
+		}
+	}
+
+	emit(opcode::move, r + 1, r);
+
+	// compile right-hand operand
+	if(op.assoc == associativity::right)	compile<P>(r + 1);
+	else if(op.assoc == associativity::left)	compile<Precedence(P + 1)>(r + 1);
+
+	apply_fn fn = &apply_operator<OP>;
+	if constexpr(std::is_same_v<OP, op_index>)
+		if(!_parser.is_target(start))	fn = &apply_operator<op_at>;		// element is read in place, as the interpreter does
+	if(!is_pure<OP> || !fold(r, r + 1, fn, P == nscript::Unary, pos))
+		emit(opcode::apply, r, r + 1, fn, pos);
+	if(skip != npos)	label(skip);
+	return true;
+}
+
+template <nscript::Precedence P> void compiler::compile(unsigned r)
+{
+	// compile left-hand operand (for binary operators)
+	auto start = _parser.get_state();
+	compile<Precedence(P + 1)>(r);
+	if(_parser.get_token() == parser::end)	return;
+	while(std::apply([&](auto ...op) { return (compile_op<P, decltype(op)>(op, r, start) || ...); }, std::get<P>(s_operators)));
+}
+
+template<> void compiler::compile<nscript::Unary>(unsigned r)
+{
+	if(_parser.get_token() == parser::end)	return;
+	if(!std::apply([&](auto ...op) { return (compile_op<nscript::Unary, decltype(op)>(op, r, _parser.get_state()) || ...); }, std::get<nscript::Unary>(s_operators)))
+		compile<nscript::Functional>(r);
+}
+
+template<> void compiler::compile<nscript::Statement>(unsigned r)
+{
+	compile<nscript::Assignment>(r);
+	if(_parser.get_token() == parser::comma) {
+		emit(opcode::array, r + 1, r);
+		do {
+			emit(opcode::nil, r + 2);
+			_parser.next();
+			compile<nscript::Assignment>(r + 2);
+			emit(opcode::append, r + 1, r + 2);
+		} while(_parser.get_token() == parser::comma);
+		emit(opcode::move, r, r + 1);
+	}
+}
+
+template<> void compiler::compile<nscript::Primary>(unsigned r)
+{
+	parser::token token = _parser.get_token();
+	switch(token) {
+	case parser::value:		emit(opcode::loadk, r, constant(_parser.get_value())); _parser.next(); break;
+	case parser::my:
+		if(_parser.next() != parser::name)	throw std::system_error(errc::syntax_error, "'my'");
+		_shadowed.insert(_parser.get_name());
+		emit(opcode::loadmy, r, name(_parser.get_name()));
+		_parser.next();
+		break;
+	case parser::name:	{
+		auto pos = _parser.get_state();
+		auto var = _parser.get_name();
+		_parser.next();
+		emit(_parser.is_target(pos) ? opcode::loadset : opcode::load, r, name(var), nullptr, pos);
+		if(s_pure_globals.count(var) && !_shadowed.count(var))
+			_known[r] = known_value{ context::_globals.at(var), _code->program.size() - 1 };
+		break;
+	}
+	case parser::iffunc:	_parser.next(); compile<nscript::Assignment>(r); compile_if<nscript::Assignment>(r); break;
+	case parser::lambda:
+	case parser::func:		compile_func(r); break;
+	case parser::forloop:	compile_for(r); break;
+	case parser::object:	compile_obj(r); break;
+	case parser::lpar:
+	case parser::lsquare:
+		_parser.next();
+		emit(opcode::nil, r);
+		compile<nscript::Statement>(r);
+		_parser.check_pair(token);
+		break;
+	case parser::lcurly:
+		_parser.next();
+		emit(opcode::push);
+		compile<nscript::Script>(r);
+		emit(opcode::pop);
+		_parser.check_pair(token);
+		break;
+	case parser::end:		throw std::system_error(errc::unexpected_eof);
+	}
+}
+
+// Compile branch of conditional statement, dropping it if condition is constant and the branch is never taken
+template<nscript::Precedence P> void compiler::compile_branch(unsigned r, bool live)
+{
+	if(live)	return compile<P>(r);
+	auto from = _code->program.size(), functions = _code->functions.size(), label = _label;
+	auto pos = _parser.get_state();
+	_label = from;
+	compile<P>(r);
+	dump(pos, "dropped");
+	discard(from);
+	_code->functions.resize(functions);
+	_label = label;
+}
+
+// Compile "if <cond> <true-part> [else <part>]" statement
+template<nscript::Precedence P> void compiler::compile_if(unsigned r)
+{
+	if(auto cond = known(r); cond && _options.fold) {
+		bool taken;
+		value_t value = cond->value;
+		try	{ taken = to_bool(*value); }
+		catch(...)	{ cond = nullptr; }		// leave errors to runtime
+		if(cond) {
+			assume(cond->start);
+			compile_branch<P>(r, taken);
+			if(_parser.get_token() == parser::ifelse || _parser.get_token() == parser::colon) {
+				_parser.next();
+				compile_branch<P>(r, !taken);
+			}
+			return;
+		}
+	}
+
+	auto skip_true = emit(opcode::jumpf, r);
+	compile<P>(r);
+	if(_parser.get_token() == parser::ifelse || _parser.get_token() == parser::colon) {
+		auto skip_false = emit(opcode::jump);
+		label(skip_true);
+		_parser.next();
+		compile<P>(r);
+		label(skip_false);
+	}	else	{
+		label(skip_true);
+	}
+}
+
+// Compile "for([<start>];<cond>;[<inc>])	<body>" statement
+void compiler::compile_for(unsigned r)
+{
+	_parser.next();
+	if(_parser.get_token() != parser::lpar)		throw std::system_error(errc::syntax_error, "'for'");
+	_parser.next();
+	if(_parser.get_token() != parser::stmt) {	// start expression
+		compile<nscript::Statement>(r);
+		if(_parser.get_token() != parser::stmt)	throw std::system_error(errc::syntax_error, "'for'");
+	}
+	_parser.next();
+	auto condition = _label = _code->program.size();
+	if(_parser.get_token() != parser::stmt)	{	// exit condition
+		compile<nscript::Statement>(r);
+		if(_parser.get_token() != parser::stmt)	throw std::system_error(errc::syntax_error, "'for'");
+	}
+	auto exit = emit(opcode::jumpf, r);
+	_parser.next();
+	auto increment = _code->program.size();
+	if(_parser.get_token() != parser::rpar)	{	// increment
+		compile<nscript::Statement>(r);
+		if(_parser.get_token() != parser::rpar)	throw std::system_error(errc::syntax_error, "'for'");
+	}
+	// increment runs after the body, so cut its code out and append it later
+	std::vector<instruction> program(_code->program.begin() + increment, _code->program.end());
+	std::vector<size_t> positions(_code->positions.begin() + increment, _code->positions.end());
+	discard(increment);
+	_label = increment;
+	_parser.next();
+	compile<nscript::Statement>(r);				// body
+	auto offset = unsigned(_code->program.size() - increment);
+	for(auto& i : program)	if(is_jump(i.op))	i.b += offset;
+	_code->program.insert(_code->program.end(), program.begin(), program.end());
+	_code->positions.insert(_code->positions.end(), positions.begin(), positions.end());
+	emit(opcode::jump, 0, unsigned(condition));
+	label(exit);
+}
+
+// Compile body of function or object into separate code
+template <nscript::Precedence P> std::shared_ptr<code> compiler::compile_body(args_list&& args)
+{
+	auto body = std::make_shared<code>();
+	body->args = std::move(args);
+	_shadowed.insert(body->args.begin(), body->args.end());
+	auto outer = _code;
+	auto label = _label;
+	auto known = std::move(_known);
+	_code = body.get();
+	_label = 0;
+	_known.clear();
+	compile<P>(0);
+	if(P != nscript::Script)	tail_calls(*body);
+	if(_backend == backend::closure)	bind(*body);
+	_code = outer;
+	_label = label;
+	_known = std::move(known);
+	// variables captured by nested function are captured by enclosing one too
+	if(outer)	outer->captures.insert(body->captures.begin(), body->captures.end());
+	return body;
+}
+
+// Mark calls whose result is returned by function body, so they can replace the running function
+void compiler::tail_calls(code& body)
+{
+	auto& program = body.program;
+	// code following the call may only leave scopes and pass its result through ';' to register 0
+	auto returns = [&](size_t pc, unsigned r) {
+		for(size_t steps = 0; pc < program.size() && steps < program.size(); steps++) {
+			auto& i = program[pc];
+			if(i.op == opcode::jump)	pc = i.b;
+			else if(i.op == opcode::pop)	pc++;
+			else if(i.op == opcode::apply && i.fn == &apply_operator<op_statmt> && i.b == r)	r = i.a, pc++;
+			else	return false;
+		}
+		return pc >= program.size() && r == 0;
+	};
+	for(size_t pc = 0; pc < program.size(); pc++) {
+		auto& i = program[pc];
+		if(i.op == opcode::apply && i.fn == &apply_operator<op_call> && returns(pc + 1, i.a))	i.op = opcode::tailcall;
+	}
+}
+
+// Compile "fn [(<arguments>)] <body>" literal
+std::shared_ptr<code> compiler::function_body()
+{
+	args_list args;
+	nscript::parse_args(_parser, args);
+	if(_parser.get_token() == parser::end)	throw std::system_error(errc::syntax_error, "'fn'");
+	return compile_body<nscript::Assignment>(std::move(args));
+}
+
+// Compile "object [(<arguments>)] {<body>}" literal
+std::shared_ptr<code> compiler::object_body()
 {
 	args_list args;
-	parse_args(args);
+	nscript::parse_args(_parser, args);
 	if(_parser.get_token() == parser::lcurly)	_parser.next();
-	parser::state state = _parser.get_state();
 	if(_parser.get_token() == parser::end)	throw std::system_error(errc::syntax_error, "'object'");
-	// _varnames contains list of variables to be captured by object
-	if(!skip)	_varnames.clear();
-	parse<Script>(result, true);
-	if(!skip)	result = std::make_shared<user_class>(args, _parser.get_content(state, _parser.get_state()), &_context, &_varnames);
+	auto body = compile_body<nscript::Script>(std::move(args));
 	if(_parser.get_token() == parser::rcurly)	_parser.next();
+	return body;
+}
+
+void compiler::compile_func(unsigned r)
+{
+	auto pos = _parser.get_state();
+	_code->functions.push_back(function_body());
+	emit(opcode::func, r, unsigned(_code->functions.size() - 1), nullptr, pos);
+}
+
+void compiler::compile_obj(unsigned r)
+{
+	auto pos = _parser.get_state();
+	_code->functions.push_back(object_body());
+	emit(opcode::object, r, unsigned(_code->functions.size() - 1), nullptr, pos);
+}
+
+#pragma endregion
+
+#pragma region VM
+
+// State of running code: registers, resolved names and entered scopes
+struct frame {
+	// names resolved to variables on first use, until the scope holding the variable is left
+	struct slot {
+		const value_t*	value = nullptr;
+		size_t			level = 0;
+	};
+	frame(context& ctx, const code& body) : ctx(ctx), body(body), r(body.registers), slots(body.names.size()) {}
+	~frame()	{ for(; depth > 0; depth--)	ctx.pop(); }		// leave scopes entered by the code, even if it throws
+	const value_t& resolve(unsigned name, context::lookup mode) {
+		auto& s = slots[name];
+		if(!s.value || mode == context::lookup::local || (mode == context::lookup::assign && s.level == 0))
+			s.value = &ctx.get(body.names[name], mode, &s.level);
+		return *s.value;
+	}
+	// call in tail position, user functions are left to vm::run to replace running code
+	void call(unsigned a, unsigned b, apply_fn fn) {
+		if(auto po = get_if<object_ptr>(&r[a]); po && *po) {
+			if(auto var = object_cast<variable>(*po); var)	po = get_if<object_ptr>(&var->value());
+			if(po && object_cast<user_function>(*po)) {
+				callee = static_pointer_cast<user_function>(*po);
+				*r[b];
+				params = b;
+				// finish code following the call, ';' dereferences its left operand and the result
+				for(auto& program = body.program; pc < program.size(); ) {
+					auto& i = program[pc];
+					if(i.op == opcode::jump)	pc = i.b;
+					else {
+						if(i.op == opcode::apply)	*r[i.a], derefs++;
+						pc++;
+					}
+				}
+				return;
+			}
+		}
+		fn(r[a], r[b]);
+	}
+	// left operand of '&&' or '||' decides the result, if it is the given boolean
+	bool decides(unsigned a, bool value) {
+		value_t left = r[a];
+		if(auto pb = get_if<bool>(&*left); !pb || *pb != value)	return false;
+		r[a] = value;
+		return true;
+	}
+	void push()		{ ctx.push(); depth++; }
+	void pop() {
+		depth--;
+		if(ctx.pop())
+			for(auto& s : slots)	if(s.level > ctx.depth())	s.value = nullptr;
+	}
+
+	context&				ctx;
+	const code&				body;
+	params_t				r;
+	std::vector<slot, arena_allocator<slot>>	slots;
+	size_t					pc = 0;
+	size_t					depth = 0;
+	ref_ptr<user_function>	callee;		// user function called in tail position
+	unsigned				params = 0;			// register holding its arguments
+	size_t					derefs = 0;			// dereferences of its result
+};
+
+value_t vm::run(const code& code)
+{
+	// calls in tail position replace running code and context instead of nesting
+	context* ctx = &_context;
+	std::optional<context> callee_context;
+	ref_ptr<user_function> callee;
+	size_t derefs = 0;
+	for(const nscript3::code* body = &code;;) {
+		value_t params;
+		{
+			frame f(*ctx, *body);
+			execute(f);
+			if(!f.callee) {
+				for(; derefs > 0; derefs--)	*f.r[0];
+				return f.r[0];
+			}
+			callee = std::move(f.callee);
+			params = std::move(f.r[f.params]);
+			derefs += f.derefs;
+		}
+		callee_context.reset();
+		callee_context.emplace(&callee->_context);
+		process_args(callee->_code->args, params, *callee_context);
+		ctx = &*callee_context;
+		body = callee->_code.get();
+	}
+}
+
+void vm::execute(frame& f)
+{
+	auto& code = f.body;
+	auto& r = f.r;
+	try	{
+		if(!code.steps.empty()) {
+			auto steps = code.steps.data();
+			for(auto end = code.steps.size(); f.pc < end; ) {
+				auto& s = steps[f.pc++];
+				s.run(f, s);
+			}
+		}	else	{
+			auto program = code.program.data();
+			for(auto end = code.program.size(); f.pc < end; ) {
+				auto& i = program[f.pc++];
+				switch(i.op) {
+				case opcode::nil:		r[i.a] = value_t{}; break;
+				case opcode::move:		r[i.a] = r[i.b]; break;
+				case opcode::loadk:		r[i.a] = code.constants[i.b]; break;
+				case opcode::load:		r[i.a] = f.resolve(i.b, context::lookup::read); break;
+				case opcode::loadmy:	r[i.a] = f.resolve(i.b, context::lookup::local); break;
+				case opcode::loadset:	r[i.a] = f.resolve(i.b, context::lookup::assign); break;
+				case opcode::apply:		i.fn(r[i.a], r[i.b]); break;
+				case opcode::tailcall:	f.call(i.a, i.b, i.fn); break;
+				case opcode::jump:		f.pc = i.b; break;
+				case opcode::jumpf:		if(!to_bool(*r[i.a]))	f.pc = i.b; break;
+				case opcode::land:		if(f.decides(i.a, false))	f.pc = i.b; break;
+				case opcode::lor:		if(f.decides(i.a, true))	f.pc = i.b; break;
+				case opcode::push:		f.push(); break;
+				case opcode::pop:		f.pop(); break;
+				case opcode::array:		r[i.a] = make_ref<v_array>(std::initializer_list<value_t>{ *r[i.b] }); break;
+				case opcode::append:	static_pointer_cast<v_array>(nscript3::get<object_ptr>(r[i.a]))->items().push_back(*r[i.b]); break;
+				case opcode::func:		r[i.a] = make_ref<user_function>(code.functions[i.b], &f.ctx); break;
+				case opcode::object:	r[i.a] = make_ref<user_class>(code.functions[i.b], &f.ctx); break;
+				case opcode::item:		member(r[i.a], code.members[i.b]); break;
+				}
+			}
+		}
+	}
+	catch(...)	{ _position = code.positions[f.pc - 1]; throw; }
+}
+
+// Access member of object, using inline cache of the site for instances of user classes
+void vm::member(value_t& target, const member_site& site)
+{
+	if(auto po = get_if<object_ptr>(&target); po && *po) {
+		auto obj = po->get();
+		if(auto var = object_cast<variable>(obj); var)
+			if(auto pv = get_if<object_ptr>(&var->value()); pv)	obj = pv->get();
+		if(auto inst = object_cast<user_class::instance>(obj); inst) {
+			target = inst->member(site);
+			return;
+		}
+	}
+	op_item::apply(target, site.name);
+}
+
+#pragma endregion
+
+#pragma region Closure
+
+// Handlers of backend::closure, each one runs an instruction with operands bound at compile time
+namespace handler {
+static const value_t& constant(const step& s)	{ return *static_cast<const value_t*>(s.operand); }
+static void nil(frame& f, const step& s)		{ f.r[s.a] = value_t{}; }
+static void move(frame& f, const step& s)		{ f.r[s.a] = f.r[s.b]; }
+static void loadk(frame& f, const step& s)		{ f.r[s.a] = constant(s); }
+static void load(frame& f, const step& s)		{ f.r[s.a] = f.resolve(s.b, context::lookup::read); }
+static void loadmy(frame& f, const step& s)		{ f.r[s.a] = f.resolve(s.b, context::lookup::local); }
+static void loadset(frame& f, const step& s)	{ f.r[s.a] = f.resolve(s.b, context::lookup::assign); }
+static void apply(frame& f, const step& s)		{ s.fn(f.r[s.a], f.r[s.b]); }
+static void tailcall(frame& f, const step& s)	{ f.call(s.a, s.b, s.fn); }
+static void applyk(frame& f, const step& s)		{ f.r[s.b] = constant(s); f.pc++; s.fn(f.r[s.a], f.r[s.b]); }
+static void applyv(frame& f, const step& s)		{ f.r[s.b] = f.resolve(s.c, context::lookup::read); f.pc++; s.fn(f.r[s.a], f.r[s.b]); }
+static void jump(frame& f, const step& s)		{ f.pc = s.b; }
+static void jumpf(frame& f, const step& s)		{ if(!to_bool(*f.r[s.a]))	f.pc = s.b; }
+static void land(frame& f, const step& s)		{ if(f.decides(s.a, false))	f.pc = s.b; }
+static void lor(frame& f, const step& s)		{ if(f.decides(s.a, true))	f.pc = s.b; }
+static void push(frame& f, const step& s)		{ f.push(); }
+static void pop(frame& f, const step& s)		{ f.pop(); }
+static void array(frame& f, const step& s)		{ f.r[s.a] = make_ref<v_array>(std::initializer_list<value_t>{ *f.r[s.b] }); }
+static void append(frame& f, const step& s)		{ static_pointer_cast<v_array>(nscript3::get<object_ptr>(f.r[s.a]))->items().push_back(*f.r[s.b]); }
+static void func(frame& f, const step& s)		{ f.r[s.a] = make_ref<user_function>(*static_cast<const code_ptr*>(s.operand), &f.ctx); }
+static void object(frame& f, const step& s)		{ f.r[s.a] = make_ref<user_class>(*static_cast<const code_ptr*>(s.operand), &f.ctx); }
+static void item(frame& f, const step& s)		{ vm::member(f.r[s.a], *static_cast<const member_site*>(s.operand)); }
+}
+
+// Bind instructions to handlers, fusing loads of right-hand operands into operators using them
+void compiler::bind(code& code)
+{
+	auto& program = code.program;
+	std::vector<bool> target(program.size() + 1);
+	for(auto& i : program)	if(is_jump(i.op))	target[i.b] = true;
+
+	code.steps.reserve(program.size());
+	for(size_t pc = 0; pc < program.size(); pc++) {
+		auto& i = program[pc];
+		step s{ nullptr, i.a, i.b, 0, i.fn, nullptr };
+		switch(i.op) {
+		case opcode::nil:		s.run = handler::nil; break;
+		case opcode::move:		s.run = handler::move; break;
+		case opcode::loadk:		s.run = handler::loadk; s.operand = &code.constants[i.b]; break;
+		case opcode::load:		s.run = handler::load; break;
+		case opcode::loadmy:	s.run = handler::loadmy; break;
+		case opcode::loadset:	s.run = handler::loadset; break;
+		case opcode::apply:		s.run = handler::apply; break;
+		case opcode::tailcall:	s.run = handler::tailcall; break;
+		case opcode::jump:		s.run = handler::jump; break;
+		case opcode::jumpf:		s.run = handler::jumpf; break;
+		case opcode::land:		s.run = handler::land; break;
+		case opcode::lor:		s.run = handler::lor; break;
+		case opcode::push:		s.run = handler::push; break;
+		case opcode::pop:		s.run = handler::pop; break;
+		case opcode::array:		s.run = handler::array; break;
+		case opcode::append:	s.run = handler::append; break;
+		case opcode::func:		s.run = handler::func; s.operand = &code.functions[i.b]; break;
+		case opcode::object:	s.run = handler::object; s.operand = &code.functions[i.b]; break;
+		case opcode::item:		s.run = handler::item; s.operand = &code.members[i.b]; break;
+		}
+		// the fused step skips the operator's own one, which still serves jumps landing on it
+		if(pc + 1 < program.size() && !target[pc + 1] && program[pc + 1].op == opcode::apply && program[pc + 1].b == i.a) {
+			auto& next = program[pc + 1];
+			if(i.op == opcode::loadk)	s = { handler::applyk, next.a, next.b, 0, next.fn, s.operand };
+			if(i.op == opcode::load)	s = { handler::applyv, next.a, next.b, i.b, next.fn, nullptr };
+		}
+		code.steps.push_back(s);
+	}
 }
 
 #pragma endregion
@@ -417,9 +1498,57 @@ static std::unordered_map<string_t, parser::token> s_keywords = {
 
 parser::parser() {}
 
-parser::token parser::next()
+// Read all tokens of content, an error stops reading and is reported when its token is reached
+void parser::tokenize()
+{
+	_tokens.clear();
+	_values.assign(1, value_t{});
+	_names.assign(1, symbol{});
+	_error = nullptr;
+	_index = 0;
+	_pos = 0;
+	_value = value_t{};
+	_name.clear();
+	std::unordered_map<string_t, unsigned> names;
+	for(;;) {
+		auto position = _pos;
+		try	{
+			read_token();
+		}
+		catch(...)	{
+			_error = std::current_exception();
+			_tokens.push_back({ err, 0, 0, position });
+			return;
+		}
+		unsigned value = 0, name = 0;
+		if(_token == parser::value || _token == dot)	value = unsigned(_values.size()), _values.push_back(_value);
+		if(!_name.empty()) {
+			auto p = names.try_emplace(_name, unsigned(_names.size()));
+			if(p.second)	_names.push_back(_name);
+			name = p.first->second;
+		}
+		_tokens.push_back({ _token, value, name, position });
+		if(_token == end)	return;
+	}
+}
+
+void parser::set_state(state state)
+{
+	_index = std::min(state, _tokens.size() - 1);
+	if(_tokens[_index].kind == err)	std::rethrow_exception(_error);
+}
+
+// Jump over region, if it was parsed in skip mode from current token with the same precedence
+bool parser::skip(int level)
+{
+	auto& token = _tokens[_index];
+	if(token.skip_level != level)	return false;
+	set_state(token.skip_to);
+	return true;
+}
+
+parser::token parser::read_token()
 {
-	_lastpos = _pos;
 	int c, cc;
 	while(isspace(c = read()));
 	switch(c)	{
@@ -469,7 +1598,8 @@ parser::token parser::next()
 void parser::read_number(int c)
 {
 	enum number_stage {nsint, nsdot, nsexp, nspwr, nshex} stage = nsint;
-	int base = 10, m = c - '0';
+	int base = 10;
+	int64_t m = c - '0';
 	int e1 = 0, e2 = 0, esign = 1;
 	bool overflow = false;
 
@@ -479,18 +1609,18 @@ void parser::read_number(int c)
 		if(isdigit(c))	{
 			int v = c - '0';
 			if(stage == nsint || stage == nshex) {
-				if(m > (INT_MAX - v) / base)	throw std::system_error(std::make_error_code(std::errc::value_too_large), "number");
+				if(m > (INT64_MAX - v) / base)	throw std::system_error(std::make_error_code(std::errc::value_too_large), "number");
 				m = m * base + v;
 			}
 			else if(stage == nsexp)		stage = nspwr;
 			else if(stage == nsdot && !overflow)	{
-				if(m > (INT_MAX - v) / base)	overflow = true;
+				if(m > (INT64_MAX - v) / base)	overflow = true;
 				else							m = m * base + v, e1--;
 			}
 			if(stage == nspwr)		e2 = e2 * 10  + v;
 		}	else if(isxdigit(c) && stage == nshex)		{
 			int v = 10 + (toupper(c) - 'A');
-			if(m > (INT_MAX - v) / base)	throw std::system_error(std::make_error_code(std::errc::value_too_large), "number");
+			if(m > (INT64_MAX - v) / base)	throw std::system_error(std::make_error_code(std::errc::value_too_large), "number");
 			m = m * base + v;
 		}	else if(c == '.')		{
 			if(stage > nsint)	break;
@@ -505,8 +1635,8 @@ void parser::read_number(int c)
 	};
 	back();
 	if(stage == nsexp)	throw std::system_error(errc::syntax_error, "number");
-	if(stage == nsint || stage == nshex)	_value = double(m);					// integer
-	else									_value = m * pow(10., e1+esign*e2);	// floating-point
+	if(stage == nsint || stage == nshex)	_value = m;									// integer
+	else									_value = double(m) * pow(10., e1+esign*e2);	// floating-point
 	_token = parser::value;
 }
 
@@ -532,14 +1662,113 @@ void parser::read_name(int c)
 	back();
 }
 
+// Whether expression from <start> to <after> is assigned to, by assignment after it or by '++' or '--' before it
+bool parser::is_target(state start, state after) const
+{
+	while(_tokens[after].kind == rpar)	after++;		// target may be parenthesized
+	switch(_tokens[after].kind) {
+	case assign: case plusset: case minusset: case mulset: case divset: case idivset: case setvar: case unaryplus: case unaryminus:
+		return true;
+	case lsquare: case lpar: case dot:		// expression goes on, the target is further
+		return false;
+	default:
+		while(start > 0 && _tokens[start - 1].kind == lpar)	start--;
+		return start > 0 && (_tokens[start - 1].kind == unaryplus || _tokens[start - 1].kind == unaryminus);
+	}
+}
+
+// Collect names assigned to, they may hide built-ins
+void parser::find_assigned()
+{
+	_assigned.clear();
+	for(state i = 0; i + 1 < _tokens.size(); i++)
+		if(_tokens[i].kind == name && is_target(i, i + 1))	_assigned.insert(_names[_tokens[i].name]);
+}
+
 void parser::check_pair(parser::token token)
 {
-	if(token == lpar && _token != rpar)			throw std::system_error(errc::missing_character, "')'");
-	if(token == lsquare && _token != rsquare)	throw std::system_error(errc::missing_character, "']'");
-	if(token == lcurly && _token != rcurly)		throw std::system_error(errc::missing_character, "'}'");
+	if(token == lpar && get_token() != rpar)		throw std::system_error(errc::missing_character, "')'");
+	if(token == lsquare && get_token() != rsquare)	throw std::system_error(errc::missing_character, "']'");
+	if(token == lcurly && get_token() != rcurly)	throw std::system_error(errc::missing_character, "'}'");
 	if(token == lpar || token == lsquare || token == lcurly)	next();
 }
 
 #pragma endregion
 
-}
\ No newline at end of file
+#pragma region Engine pool
+
+engine_pool::engine_pool(size_t size, const std::function<void(nscript&)>& setup) : _size(size), _slots(new slot[size])
+{
+	for(size_t i = size; i-- > 0; ) {
+		if(setup)	setup(_slots[i].engine);
+		_slots[i].engine.mark();
+		push(_slots[i]);
+	}
+}
+
+engine_pool::slot* engine_pool::pop() noexcept
+{
+	auto head = _free.load(std::memory_order_acquire);
+	for(;;) {
+		auto i = unsigned(head);
+		if(!i)	return nullptr;
+		auto next = _slots[i - 1].next.load(std::memory_order_relaxed);		// stale if the slot was taken meanwhile, then the count differs
+		if(_free.compare_exchange_weak(head, ((head >> 32) + 1) << 32 | next, std::memory_order_acquire))	return &_slots[i - 1];
+	}
+}
+
+void engine_pool::push(slot& s) noexcept
+{
+	auto i = unsigned(&s - _slots.get()) + 1;
+	auto head = _free.load(std::memory_order_relaxed);
+	do	s.next.store(unsigned(head), std::memory_order_relaxed);
+	while(!_free.compare_exchange_weak(head, ((head >> 32) + 1) << 32 | i, std::memory_order_release, std::memory_order_relaxed));
+}
+
+engine_pool::lease engine_pool::checkout()
+{
+	auto start = clock::now();
+	auto s = pop();
+	if(!s) {
+		_waits.fetch_add(1, std::memory_order_relaxed);
+		_waiting.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);		// either this thread sees the engine returned or the returning one sees it waiting
+		{
+			std::unique_lock lock(_lock);
+			_returned.wait(lock, [&] { return (s = pop()) != nullptr; });
+		}
+		_waiting.fetch_sub(1);
+		auto now = clock::now();
+		auto waited = (now - start).count();
+		_wait_time.fetch_add(waited, std::memory_order_relaxed);
+		for(auto max = _max_wait.load(std::memory_order_relaxed); waited > max && !_max_wait.compare_exchange_weak(max, waited, std::memory_order_relaxed); );
+		start = now;
+	}
+	auto in_use = _in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+	for(auto peak = _peak.load(std::memory_order_relaxed); in_use > peak && !_peak.compare_exchange_weak(peak, in_use, std::memory_order_relaxed); );
+	_checkouts.fetch_add(1, std::memory_order_relaxed);
+	return lease(this, s, start);
+}
+
+void engine_pool::checkin(slot& s, clock::time_point start)
+{
+	s.engine.reset();
+	_busy.fetch_add((clock::now() - start).count(), std::memory_order_relaxed);
+	_in_use.fetch_sub(1, std::memory_order_relaxed);
+	push(s);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(!_waiting.load(std::memory_order_relaxed))	return;
+	{ std::lock_guard lock(_lock); }			// a thread about to sleep holds the lock, so it is asleep now
+	_returned.notify_one();
+}
+
+engine_pool::stats engine_pool::get_stats() const
+{
+	auto elapsed = double((clock::now() - _created).count()) * _size;
+	return { _size, _in_use.load(), _peak.load(), _checkouts.load(), _waits.load(),
+		clock::duration(_wait_time.load()), clock::duration(_max_wait.load()), elapsed > 0 ? _busy.load() / elapsed : 0 };
+}
+
+#pragma endregion
+
+}
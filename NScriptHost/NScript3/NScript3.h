@@ -5,14 +5,23 @@
 
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iosfwd>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
 #include <system_error>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -45,77 +54,354 @@ std::error_condition make_error_condition(errc e);
 
 struct i_object;
 class v_array;
+class value_t;
+class symbol;
 using std::string_view;
 using string_t = std::string;
-using object_ptr = std::shared_ptr<i_object>;
-using array_ptr = std::shared_ptr<v_array>;
-using value_t = std::variant<object_ptr, bool, double, string_t>;
-using params_t = std::vector<value_t>;
-
-std::string to_string(value_t v);
-bool to_bool(value_t v);
-double to_double(value_t v);
-tm to_date(value_t v);
-params_t* to_array_if(const value_t& v);
-params_t* to_array_if(const object_ptr& o);
-array_ptr to_array(const value_t& v);
-inline bool is_empty(const value_t& v) { auto po = std::get_if<object_ptr>(&v); return po && po->get() == nullptr; }
+using date_t = std::chrono::time_point<std::chrono::system_clock, std::chrono::seconds>;	// local time, without time zone
+using value_visitor = std::function<void(const value_t&)>;
+
+// Bump allocator of the current thread for script objects, string boxes, arrays and scopes. Memory of a chunk
+// is reused once all blocks allocated from it are freed, so values escaping an evaluation only keep their chunk
+class arena {
+public:
+	static void* allocate(size_t size);
+	static void deallocate(void* block, size_t size) noexcept;
+	static void rewind() noexcept;			// start over the current chunk if nothing allocated from it is alive
+private:
+	struct chunk;
+	struct pool;
+	static thread_local pool*	s_pool;
+	static pool& local();
+};
+
+template<class T> struct arena_allocator {
+	using value_type = T;
+	arena_allocator() noexcept = default;
+	template<class U> arena_allocator(const arena_allocator<U>&) noexcept {}
+	T* allocate(size_t n)						{ return static_cast<T*>(arena::allocate(n * sizeof(T))); }
+	void deallocate(T* p, size_t n) noexcept	{ arena::deallocate(p, n * sizeof(T)); }
+	template<class U> bool operator==(const arena_allocator<U>&) const noexcept	{ return true; }
+	template<class U> bool operator!=(const arena_allocator<U>&) const noexcept	{ return false; }
+};
+
+// Reference count embedded in script objects and string boxes. Objects confined to one engine are counted
+// with plain loads and stores, objects reachable from several threads are marked shared and counted atomically.
+// Immortal objects, as built-ins living until the process ends, are not counted at all, so reading them writes nothing
+class ref_count {
+	enum class mode : unsigned char { local, shared, immortal };
+	mutable std::atomic<unsigned>	_refs = 0;
+	mutable mode					_mode = mode::local;
+public:
+	ref_count() = default;
+	ref_count(const ref_count&) : ref_count() {}			// a copy is a new object without references
+	ref_count& operator=(const ref_count&)	{ return *this; }
+	void add_ref() const noexcept {
+		if(_mode == mode::local)		_refs.store(_refs.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		else if(_mode == mode::shared)	_refs.fetch_add(1, std::memory_order_relaxed);
+	}
+	bool release() const noexcept {						// true if the last reference is released
+		if(_mode == mode::immortal)	return false;
+		if(_mode == mode::shared)	return _refs.fetch_sub(1, std::memory_order_acq_rel) == 1;
+		auto refs = _refs.load(std::memory_order_relaxed) - 1;
+		return _refs.store(refs, std::memory_order_relaxed), refs == 0;
+	}
+	unsigned use_count() const noexcept		{ return _refs.load(std::memory_order_acquire); }
+	bool is_local() const noexcept			{ return _mode == mode::local; }
+	void share() const noexcept				{ if(_mode == mode::local) _mode = mode::shared; }		// before the object is passed to other threads
+	void make_immortal() const noexcept		{ _mode = mode::immortal; }								// before the object is published, it is never deleted
+};
+
+// Intrusive pointer to reference counted object
+template<class T> class ref_ptr {
+	template<class U> friend class ref_ptr;
+	T*	_p = nullptr;
+public:
+	ref_ptr() noexcept = default;
+	ref_ptr(std::nullptr_t) noexcept {}
+	explicit ref_ptr(T* p) noexcept : _p(p)					{ if(_p) _p->add_ref(); }
+	ref_ptr(const ref_ptr& p) noexcept : ref_ptr(p._p)		{}
+	ref_ptr(ref_ptr&& p) noexcept : _p(p._p)				{ p._p = nullptr; }
+	template<class U, class = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+	ref_ptr(const ref_ptr<U>& p) noexcept : ref_ptr(p._p)	{}
+	template<class U, class = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+	ref_ptr(ref_ptr<U>&& p) noexcept : _p(p._p)				{ p._p = nullptr; }
+	~ref_ptr()												{ if(_p && _p->release()) delete _p; }
+	ref_ptr& operator=(ref_ptr p) noexcept					{ std::swap(_p, p._p); return *this; }
+	T* get() const noexcept									{ return _p; }
+	T& operator*() const noexcept							{ return *_p; }
+	T* operator->() const noexcept							{ return _p; }
+	explicit operator bool() const noexcept					{ return _p != nullptr; }
+	template<class U> bool operator==(const ref_ptr<U>& p) const noexcept	{ return _p == p._p; }
+	template<class U> bool operator!=(const ref_ptr<U>& p) const noexcept	{ return _p != p._p; }
+	bool operator==(std::nullptr_t) const noexcept			{ return _p == nullptr; }
+	bool operator!=(std::nullptr_t) const noexcept			{ return _p != nullptr; }
+	bool operator<(const ref_ptr& p) const noexcept			{ return std::less<T*>()(_p, p._p); }
+};
+template<class T, class... A> ref_ptr<T> make_ref(A&&... args)					{ return ref_ptr<T>(new T(std::forward<A>(args)...)); }
+template<class T, class U> ref_ptr<T> static_pointer_cast(const ref_ptr<U>& p)	{ return ref_ptr<T>(static_cast<T*>(p.get())); }
+
+using object_ptr = ref_ptr<i_object>;
+using array_ptr = ref_ptr<v_array>;
+
+// Kinds of built-in objects, recognized by hot paths without RTTI. Extension objects are external
+enum class object_kind : unsigned char { external, variable, array, array_item, hash, hash_item, builtin, function, instance };
 
 // Interface for extension objects
-struct i_object {
+struct i_object : ref_count {
+	i_object(object_kind kind = object_kind::external) : kind(kind) {}
+	virtual ~i_object() {}
+	static void* operator new(size_t size)				{ return arena::allocate(size); }
+	static void operator delete(void* p, size_t size)	{ arena::deallocate(p, size); }
+	const object_kind kind;
 	virtual value_t create() const = 0;					// return new <object>
 	virtual value_t get()  = 0;							// return <object>
 	virtual void set(value_t value) = 0;				// <object> = value
 	virtual value_t call(value_t params) = 0;			// return <object>(params)
-	virtual value_t item(string_t item) = 0;			// return <object>.item
+	virtual value_t item(symbol item) = 0;				// return <object>.item
 	virtual value_t index(value_t index) = 0;			// return <object>[index]
+	virtual value_t at(const value_t& key);				// return <object>[key] for reading, index(key) by default
 	virtual string_t print() const = 0;
+	virtual void parts(const value_visitor& visit) const {}	// values held by the object, for share()
+	void share() const;									// mark object and everything reachable from it before passing it to other threads
+};
+
+// Built-in object of class T or nullptr, checked by kind instead of dynamic_cast
+template<class T> T* object_cast(i_object* o)			{ return o && o->kind == T::kind_id ? static_cast<T*>(o) : nullptr; }
+template<class T> T* object_cast(const object_ptr& o)	{ return object_cast<T>(o.get()); }
+
+
+// Reference counted out-of-line payload of value_t, shared by copies of the value
+template<class T> struct boxed : ref_count {
+	template<class... A> boxed(A&&... args) : value(std::forward<A>(args)...) {}
+	static void* operator new(size_t size)				{ return arena::allocate(size); }
+	static void operator delete(void* p, size_t size)	{ arena::deallocate(p, size); }
+	T						value;			// modified only while not shared
 };
 
-using args_list = std::vector<string_t>;
+// Compact 16-byte value: numbers, integers, dates and booleans are stored inline, strings in shared boxes, objects by intrusive pointer.
+// Empty value is an empty object, as the first alternative of former std::variant<object_ptr, bool, double, string_t>
+class value_t {
+public:
+	enum class tag : unsigned char { object, boolean, number, integer, date, string };
+
+	value_t() noexcept						: _object(nullptr), _tag(tag::object) {}
+	value_t(bool b) noexcept				: _bool(b), _tag(tag::boolean) {}
+	value_t(double d) noexcept				: _number(d), _tag(tag::number) {}
+	template<class T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>, int> = 0>
+	value_t(T i) noexcept					: _integer(int64_t(i)), _tag(tag::integer) {}
+	value_t(date_t d) noexcept				: _date(d), _tag(tag::date) {}
+	value_t(string_t s)						: _string(new boxed<string_t>(std::move(s))), _tag(tag::string) { _string->add_ref(); }
+	value_t(const char* s)					: value_t(string_t(s)) {}
+	value_t(object_ptr o) noexcept			: _object(std::move(o)), _tag(tag::object) {}
+	template<class T, class = std::enable_if_t<std::is_convertible_v<T*, i_object*>>>
+	value_t(ref_ptr<T> o) noexcept			: value_t(object_ptr(std::move(o))) {}
+	value_t(const value_t& v) noexcept		: _integer(v._integer), _tag(v._tag) {
+		if(_tag == tag::string)			_string->add_ref();
+		else if(_tag == tag::object)	new(&_object) object_ptr(v._object);
+	}
+	value_t(value_t&& v) noexcept			: _integer(v._integer), _tag(v._tag) {
+		if(_tag == tag::object)			new(&_object) object_ptr(std::move(v._object));
+		else if(_tag == tag::string)	new(&v._object) object_ptr(), v._tag = tag::object;
+	}
+	~value_t()								{ release(); }
+	value_t& operator=(const value_t& v) noexcept	{ value_t(v).swap(*this); return *this; }
+	value_t& operator=(value_t&& v) noexcept		{ value_t(std::move(v)).swap(*this); return *this; }
+	void swap(value_t& v) noexcept			{ std::swap(_integer, v._integer); std::swap(_tag, v._tag); }
+
+	tag type() const						{ return _tag; }
+	const bool& boolean() const				{ return _bool; }
+	const double& number() const			{ return _number; }
+	const int64_t& integer() const			{ return _integer; }
+	const date_t& date() const				{ return _date; }
+	const string_t& string() const			{ return _string->value; }
+	const object_ptr& object() const		{ return _object; }
+
+	// Mark string or object, with all values reachable from it, as reachable from other threads
+	void share() const						{ if(_tag == tag::string) _string->share(); else if(_tag == tag::object && _object) _object->share(); }
+	void make_immortal() const				{ if(_tag == tag::string) _string->make_immortal(); else if(_tag == tag::object && _object) _object->make_immortal(); }
+
+	// Append to string in place, if no other value shares it. Amortized O(1), as the buffer grows geometrically
+	bool append(string_view s) {
+		if(_tag != tag::string || _string->use_count() != 1)	return false;
+		return _string->value.append(s), true;
+	}
+
+	friend bool operator==(const value_t& x, const value_t& y) {
+		if(x._tag != y._tag)	return false;
+		switch(x._tag) {
+		case tag::boolean:	return x._bool == y._bool;
+		case tag::number:	return x._number == y._number;
+		case tag::integer:	return x._integer == y._integer;
+		case tag::date:		return x._date == y._date;
+		case tag::string:	return x.string() == y.string();
+		default:			return x.object() == y.object();
+		}
+	}
+	friend bool operator!=(const value_t& x, const value_t& y)	{ return !(x == y); }
+
+private:
+	void release() {
+		if(_tag == tag::string && _string->release())	delete _string;
+		if(_tag == tag::object)	_object.~object_ptr();
+	}
+
+	union {
+		object_ptr			_object;
+		boxed<string_t>*	_string;
+		bool				_bool;
+		double				_number;
+		int64_t				_integer;
+		date_t				_date;
+	};
+	tag		_tag;
+};
+
+static_assert(sizeof(value_t) == 16, "value_t is expected to fit two machine words");
+using params_t = std::vector<value_t, arena_allocator<value_t>>;
+
+// std::variant-like access to value_t
+template<class T> const T* get_if(const value_t* v) {
+	if constexpr(std::is_same_v<T, object_ptr>)		return v->type() == value_t::tag::object  ? &v->object()  : nullptr;
+	else if constexpr(std::is_same_v<T, bool>)		return v->type() == value_t::tag::boolean ? &v->boolean() : nullptr;
+	else if constexpr(std::is_same_v<T, double>)	return v->type() == value_t::tag::number  ? &v->number()  : nullptr;
+	else if constexpr(std::is_same_v<T, int64_t>)	return v->type() == value_t::tag::integer ? &v->integer() : nullptr;
+	else if constexpr(std::is_same_v<T, date_t>)	return v->type() == value_t::tag::date    ? &v->date()    : nullptr;
+	else											return v->type() == value_t::tag::string  ? &v->string()  : nullptr;
+}
+template<class T> const T& get(const value_t& v)	{ if(auto p = get_if<T>(&v); p) return *p; throw std::bad_variant_access(); }
+
+template<class F> decltype(auto) visit(F&& f, const value_t& v) {
+	switch(v.type()) {
+	case value_t::tag::boolean:	return f(v.boolean());
+	case value_t::tag::number:	return f(v.number());
+	case value_t::tag::integer:	return f(v.integer());
+	case value_t::tag::date:	return f(v.date());
+	case value_t::tag::string:	return f(v.string());
+	default:					return f(v.object());
+	}
+}
+template<class F> decltype(auto) visit(F&& f, const value_t& v1, const value_t& v2) {
+	return visit([&](const auto& x) -> decltype(auto) { return visit([&](const auto& y) -> decltype(auto) { return f(x, y); }, v2); }, v1);
+}
+
+std::string to_string(const value_t& v);
+bool to_bool(const value_t& v);
+double to_double(const value_t& v);
+int64_t to_int(const value_t& v);
+date_t to_date(const value_t& v);
+params_t* to_array_if(const value_t& v);
+params_t* to_array_if(const object_ptr& o);
+array_ptr to_array(const value_t& v);
+inline bool is_empty(const value_t& v) { auto po = get_if<object_ptr>(&v); return po && po->get() == nullptr; }
+
+// Interned name: equal strings share one entry, so symbols are compared and hashed as pointers.
+// The table is shared by all threads, entries live until the process ends
+class symbol {
+	struct entry {
+		const string_t	name;
+		const size_t	hash;
+	};
+	const entry*	_entry;
+	static const entry* intern(string_view name);
+	static const entry* empty()				{ static const entry* e = intern({}); return e; }
+public:
+	symbol() : _entry(empty()) {}
+	symbol(string_view name) : _entry(intern(name)) {}
+	symbol(const string_t& name) : symbol(string_view(name)) {}
+	symbol(const char* name) : symbol(string_view(name)) {}
+	const string_t& str() const				{ return _entry->name; }
+	operator const string_t&() const		{ return _entry->name; }
+	bool operator==(const symbol& s) const	{ return _entry == s._entry; }
+	bool operator!=(const symbol& s) const	{ return _entry != s._entry; }
+	bool operator<(const symbol& s) const	{ return _entry < s._entry; }		// stable order, not alphabetical
+	struct hash { size_t operator()(const symbol& s) const { return s._entry->hash; } };
+};
+
+using args_list = std::vector<symbol>;
 
 // Container for storing named objects and variables
 class context	
 {
 public:
-	typedef std::unordered_set<string_t>			var_names;
+	typedef std::unordered_set<symbol, symbol::hash>	var_names;
+	// how a name is looked up: assigning to a built-in makes a variable hiding it, 'my' makes a variable in innermost scope
+	enum class lookup : unsigned char { read, assign, local };
 	context(const context *base, const var_names *vars = nullptr);
-	void push()		{_locals.emplace_back();}
-	void pop()		{_locals.pop_back();}
-	value_t& get(string_t name, bool local = false);
-	std::optional<value_t> get(string_t name) const;
-	void set(string_t name, value_t value)		{_locals.front()[name] = value;}
+	void push()		{_depth++;}
+	bool pop()		{bool vars = _locals.back().depth == _depth--; if(vars) _locals.pop_back(); return vars;}	// whether scope had variables
+	const value_t& get(symbol name, lookup mode = lookup::read, size_t* level = nullptr);
+	std::optional<value_t> get(symbol name) const;
+	value_t& set(symbol name, value_t value)	{return _locals.front().vars[name] = value;}
+	size_t depth() const	{return _depth;}
+	using snapshot = std::vector<std::pair<symbol, value_t>>;
+	snapshot save() const;					// variables of the outermost scope
+	void restore(const snapshot& saved);	// put saved variables of the outermost scope back, dropping the rest
+	void parts(const value_visitor& visit) const	{for(auto& plane : _locals) for(auto& var : plane.vars) visit(var.second);}
 private:
-	typedef std::unordered_map<string_t, value_t>	vars_t;
-	static vars_t		_globals;
-	std::vector<vars_t>	_locals;
+	friend class compiler;
+	friend class user_class;
+	typedef std::unordered_map<symbol, value_t, symbol::hash, std::equal_to<symbol>, arena_allocator<std::pair<const symbol, value_t>>>	vars_t;
+	// variables of a scope, made when the first one is created there
+	struct plane {
+		size_t		depth = 1;
+		vars_t		vars;
+	};
+	static vars_t immortal(vars_t&& vars);
+	static const vars_t	_globals;
+	std::deque<plane, arena_allocator<plane>>	_locals;		// deque keeps variables in place while scopes are entered and left
+	size_t				_depth = 1;							// scopes entered, entering one without variables costs nothing
 };
 
-// Parser of input stream to a list of tokens
+// Parser of input stream to a list of tokens, read once into flat array
 class parser	{
 public:
-	using state = size_t;
+	using state = size_t;		// index of current token
 	enum token	{end,mod,assign,ge,gt,le,lt,nequ,name,value,land,lor,lnot,stmt,err,dot,newobj,minus,lpar,rpar,lcurly,rcurly,equ,plus,lsquare,rsquare,multiply,divide,lambda,and,or,not,pwr,comma,unaryplus,unaryminus,forloop,ifop,iffunc,ifelse,func,object,plusset, minusset, mulset, divset, idivset, setvar,my,colon,apo,mdot};
 
 	parser();
-	void init(string_view expr)	{if(!expr.empty()) _content = expr; set_state(0);}
-	token get_token()			{return _token;}
-	value_t get_value()			{return _value;}
-	string_t get_name()			{return _name;}
-	state get_state() const		{return _lastpos;}
-	void set_state(state state)	{_pos = state; _token=end; next();}
-	string_t get_content(state begin, state end)	{return _content.substr(begin, end-begin);}
+	void init(string_view expr)	{if(!expr.empty()) _content = expr; tokenize(); find_assigned(); set_state(0);}
+	token get_token() const				{return _tokens[_index].kind;}
+	const value_t& get_value() const	{return _values[_tokens[_index].value];}
+	const symbol& get_name() const		{return _names[_tokens[_index].name];}
+	state get_state() const				{return _index;}
+	void set_state(state state);
+	size_t get_position(state state) const	{return state < _tokens.size() ? _tokens[state].position : _content.length();}
+	string_t get_content(state begin, state end) const	{return _content.substr(get_position(begin), get_position(end) - get_position(begin));}
 	void check_pair(token token);
-	token next();
+	token next()						{set_state(_index + 1); return get_token();}
+	bool skip(int level);
+	void skipped(state from, int level)	{_tokens[from].skip_to = _index; _tokens[from].skip_level = level;}
+	bool is_target(state start) const	{return is_target(start, _index);}
+	const context::var_names& assigned() const	{return _assigned;}
 private:
+	bool is_target(state start, state after) const;
+	void find_assigned();
+	struct entry {
+		token		kind;
+		unsigned	value;				// index of literal value
+		unsigned	name;				// index of name
+		size_t		position;			// source position, before whitespace preceding the token
+		state		skip_to = 0;		// end of region starting here, once it is parsed in skip mode
+		int			skip_level = -1;	// precedence the region was parsed with
+	};
 	int			_decpt = std::use_facet<std::numpunct<char>>(std::locale()).decimal_point();
-	token		_token;
 	string_t	_content;
+	std::vector<entry>		_tokens;
+	std::vector<value_t>	_values;
+	std::vector<symbol>		_names;
+	std::exception_ptr		_error;		// error reading the last token
+	context::var_names		_assigned;	// names assigned to anywhere in content
+	state		_index = 0;
+
+	// tokenizer state
+	token		_token;
 	state		_pos = 0;
-	state		_lastpos = 0;
 	value_t		_value;
 	string_t	_name;
 
+	void tokenize();
+	token read_token();
 	int peek()			{ if(_pos >= _content.length())	return 0; int c = _content[_pos]; return c < 0 ? c + 256 : c; }
 	int read()			{auto c = peek(); _pos++; return c;}
 	void back()				{_pos--;}
@@ -131,6 +417,35 @@ struct error_info {
 	size_t			position;
 };
 
+// Script execution backends: parsing on every run, register machine, or compiled code bound to handlers
+enum class backend { interpreter, bytecode, closure };
+
+// Compiler settings
+struct compile_options {
+	bool			fold = true;		// evaluate constant expressions, calls of pure built-ins (unless shadowed by script) and constant branches at compile time
+	std::ostream*	dump = nullptr;		// receives a line for every folded expression and dropped branch
+};
+
+struct code;
+using code_ptr = std::shared_ptr<const code>;
+
+// Immutable result of nscript::compile, can be shared between threads and evaluated many times
+class compiled_script
+{
+public:
+	compiled_script()	{}
+	explicit operator bool() const	{ return _code != nullptr; }
+private:
+	friend class nscript;
+	compiled_script(code_ptr code, string_view source) : _code(code), _source(std::make_shared<const string_t>(source)) {}
+	code_ptr							_code;
+	std::shared_ptr<const string_t>		_source;
+};
+
+// Values of one variable or results for every row of batch evaluation, alternatives follow value_t::tag
+using column = std::variant<std::vector<value_t>, std::vector<bool>, std::vector<double>, std::vector<int64_t>, std::vector<date_t>, std::vector<string_t>>;
+using column_refs = std::vector<std::pair<symbol, const column*>>;		// named input columns, not copied
+
 // Main class for executing scripts
 class nscript
 {
@@ -139,39 +454,114 @@ public:
 	nscript() : _context(nullptr)	{}
 	~nscript(void)					{};
 	std::tuple<bool, value_t> eval(string_view script);
-	void add(string_t name, value_t object)	{ _context.set(name, object); }
-	error_info get_error_info() { return { _last_error, _parser.get_content(0, -1), _parser.get_state() }; }
+	std::tuple<bool, value_t> eval(const compiled_script& script);
+	compiled_script compile(string_view script);
+	std::tuple<bool, value_t> eval_batch(const compiled_script& script, const column_refs& inputs, column& out, unsigned threads = 1);
+	void add(symbol name, value_t object)	{ _context.set(name, object); }
+	void set_backend(backend backend)		{ _backend = backend; }
+	void set_options(const compile_options& options)	{ _options = options; }
+	void mark();							// variables and hash items stored so far are kept by reset()
+	void reset();							// return to variables and hash items of mark(), clear last error
+	error_info get_error_info() { return { _last_error, _parser.get_content(0, -1), _parser.get_position(_parser.get_state()) }; }
 
 protected:
 	enum Precedence	{Script = 0,Statement,Assignment,Conditional,Logical,Binary,Equality,Relation,Addition,Multiplication,Power,Unary,Functional,Primary,Term};
 	friend class user_class;
-	friend class user_function;
+	friend class compiler;
 
 	template <Precedence> void parse(value_t& result, bool skip);
 	template <Precedence> void parse(parser::state state, value_t& result);
 	template <Precedence> void parse_if(value_t& result, bool skip);
-	void parse_args(args_list& args);
+	static void parse_args(parser& parser, args_list& args);
 	void parse_func(value_t& result, bool skip);
 	void parse_for(value_t& result, bool skip);
 	void parse_obj(value_t& result, bool skip);
-	template <Precedence, class OP> bool apply_op(OP op, value_t& result, bool skip);
+	template <Precedence, class OP> bool apply_op(OP op, value_t& result, bool skip, parser::state start);
+	template <class F> std::tuple<bool, value_t> protect(F action);
+	value_t execute(const code& code, const string_t* source = nullptr);
+	void eval_rows(const compiled_script& script, const column_refs& inputs, column& out, size_t begin, size_t end, const std::atomic<bool>& failed);
 
 	parser				_parser;
 
 	context				_context;
-	context::var_names	_varnames;
 	std::error_code		_last_error;
+	backend				_backend = backend::bytecode;
+	compile_options		_options;
+	std::optional<context::snapshot>	_marked;
+	object_ptr							_marked_hash;		// copy of hash at mark(), never seen by scripts
+};
+
+// Engines prepared once and lent to threads evaluating requests. Free engines are kept in a lock-free list,
+// a thread finding none sleeps until one is returned. Returned engines are reset to the state setup left them in.
+// An engine is used by one thread at a time. Setup has to share() values it adds to several engines, which makes
+// their counting safe; changing such values from several threads at once is still left to the host to avoid
+class engine_pool
+{
+	struct alignas(64) slot {						// engines of different threads do not share cache lines
+		nscript					engine;
+		std::atomic<unsigned>	next = 0;			// next free slot, 1-based
+	};
+public:
+	using clock = std::chrono::steady_clock;
+	struct stats {
+		size_t				size;
+		size_t				in_use;
+		size_t				peak;					// most engines in use at once
+		uint64_t			checkouts;
+		uint64_t			waits;					// checkouts finding no free engine
+		clock::duration		wait_time;				// total time waited for engines
+		clock::duration		max_wait;
+		double				utilization;			// part of the engines' time since the pool was made spent in returned leases
+	};
+	// Engine lent to the current thread until the lease is destroyed
+	class lease {
+	public:
+		lease(lease&& l) noexcept : _pool(l._pool), _slot(std::exchange(l._slot, nullptr)), _start(l._start) {}
+		lease& operator=(const lease&) = delete;
+		~lease()						{ if(_slot) _pool->checkin(*_slot, _start); }
+		nscript& operator*() const		{ return _slot->engine; }
+		nscript* operator->() const		{ return &_slot->engine; }
+	private:
+		friend class engine_pool;
+		lease(engine_pool* pool, slot* slot, clock::time_point start) : _pool(pool), _slot(slot), _start(start) {}
+		engine_pool*		_pool;
+		slot*				_slot;
+		clock::time_point	_start;
+	};
+
+	engine_pool(size_t size, const std::function<void(nscript&)>& setup = nullptr);
+	engine_pool(const engine_pool&) = delete;
+	engine_pool& operator=(const engine_pool&) = delete;
+	lease checkout();								// free engine, waiting for one if all are in use
+	stats get_stats() const;
+	size_t size() const		{ return _size; }
+
+private:
+	slot* pop() noexcept;
+	void push(slot& s) noexcept;
+	void checkin(slot& s, clock::time_point start);
+
+	const size_t				_size;
+	std::unique_ptr<slot[]>		_slots;
+	std::atomic<uint64_t>		_free = 0;			// first free slot, 1-based, in low half; count of changes in high half against ABA
+	std::atomic<unsigned>		_waiting = 0;		// threads sleeping until an engine is returned
+	std::mutex					_lock;				// taken only by sleeping threads and by those waking them
+	std::condition_variable		_returned;
+	const clock::time_point		_created = clock::now();
+	std::atomic<size_t>			_in_use = 0, _peak = 0;
+	std::atomic<uint64_t>		_checkouts = 0, _waits = 0;
+	std::atomic<clock::rep>		_wait_time = 0, _max_wait = 0, _busy = 0;
 };
 
 // Generic implementation of i_object interface
-class object : public i_object, public std::enable_shared_from_this<object> {
+class object : public i_object {
 public:
-	object()	{};
+	object(object_kind kind = object_kind::external) : i_object(kind) {};
 	value_t create() const				{ throw std::system_error(std::make_error_code(std::errc::not_supported), "object"); }
-	value_t get()						{ return shared_from_this(); }
+	value_t get()						{ return object_ptr(this); }
 	void set(value_t value)				{ throw std::system_error(std::make_error_code(std::errc::not_supported), "object"); }
 	value_t call(value_t params)		{ throw std::system_error(std::make_error_code(std::errc::not_supported), "object"); }
-	value_t item(string_t item)			{ throw std::system_error(std::make_error_code(std::errc::not_supported), "object"); }
+	value_t item(symbol item)			{ throw std::system_error(std::make_error_code(std::errc::not_supported), "object"); }
 	value_t index(value_t index)		{ throw std::system_error(std::make_error_code(std::errc::not_supported), "object"); }
 	string_t print() const				{ return "[object]"; }
 	virtual ~object()					{};
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <atomic>
+#include "nscript3.h"
+
+namespace nscript3 {
+
+// Register machine instruction set
+enum class opcode : unsigned char {
+	nil,			// r[a] = empty
+	move,			// r[a] = r[b]
+	loadk,			// r[a] = constants[b]
+	load,			// r[a] = context[names[b]]
+	loadmy,			// r[a] = new local variable names[b]
+	loadset,		// r[a] = context[names[b]] to assign to, new variable if it is a built-in
+	apply,			// r[a] = fn(r[a], r[b])
+	tailcall,		// r[a] = r[a](r[b]), replacing running code if r[a] is user function
+	jump,			// goto b
+	jumpf,			// if(!*r[a]) goto b
+	land,			// if(*r[a] == false) r[a] = false, goto b
+	lor,			// if(*r[a] == true) r[a] = true, goto b
+	push,			// enter scope
+	pop,			// leave scope
+	array,			// r[a] = [*r[b]]
+	append,			// r[a] += *r[b]
+	func,			// r[a] = fn functions[b]
+	object,			// r[a] = object functions[b]
+	item,			// r[a] = r[a].members[b]
+};
+
+inline bool is_jump(opcode op)	{ return op == opcode::jump || op == opcode::jumpf || op == opcode::land || op == opcode::lor; }
+
+using apply_fn = void(*)(value_t& result, value_t& right);
+
+struct instruction {
+	opcode		op;
+	unsigned	a;			// target register
+	unsigned	b;			// source register, constant, name, function or jump address
+	apply_fn	fn;			// operator for opcode::apply
+};
+
+// Member access site with inline cache of the member slot resolved last time
+struct member_site {
+	member_site(symbol name) : name(name) {}
+	member_site(const member_site& site) : name(site.name), cache(site.cache.load()) {}
+	const symbol					name;
+	mutable std::atomic<uint64_t>	cache = 0;		// shape id in high half, slot in low half
+};
+
+// Instruction bound to its handler and operands, for backend::closure
+struct frame;
+struct step {
+	void		(*run)(frame& f, const step& s);
+	unsigned	a, b, c;		// registers, jump address or name; c is name of variable load fused with operator
+	apply_fn	fn;
+	const void*	operand;		// constant, function body or member site
+};
+
+// Compiled script, function or object body
+struct code {
+	std::vector<instruction>	program;
+	std::vector<size_t>			positions;		// source position of each instruction
+	std::vector<value_t>		constants;
+	std::vector<symbol>			names;
+	std::vector<code_ptr>		functions;		// nested function and object bodies
+	std::vector<member_site>	members;		// member access sites
+	args_list					args;			// formal arguments of function or object
+	context::var_names			captures;		// variables referenced by body
+	unsigned					registers = 1;
+	std::vector<step>			steps;			// program bound to handlers, if compiled for closure backend
+	context::var_names			assumed;		// built-ins folded as constants, in this and nested bodies
+	code_ptr					unfolded;		// same code without folding, run where context binds any of assumed names
+	bool rebinds(const context& ctx) const;
+};
+
+// Translates script into code, following the same grammar as nscript::parse
+class compiler
+{
+public:
+	compiler(parser& parser, const compile_options& options = {}, backend backend = backend::bytecode)
+		: _parser(parser), _options(options), _backend(backend), _shadowed(parser.assigned()) {}
+	code_ptr compile()				{ return compile(&compiler::script_body); }
+	code_ptr compile_function()		{ return compile(&compiler::function_body); }
+	code_ptr compile_object()		{ return compile(&compiler::object_body); }
+
+private:
+	using Precedence = nscript::Precedence;
+	using body_fn = std::shared_ptr<code> (compiler::*)();
+
+	code_ptr compile(body_fn body);
+	std::shared_ptr<code> script_body();
+	std::shared_ptr<code> function_body();
+	std::shared_ptr<code> object_body();
+
+	template <Precedence> void compile(unsigned r);
+	template <Precedence> void compile_if(unsigned r);
+	template <Precedence, class OP> bool compile_op(OP op, unsigned r, parser::state start);
+	template <Precedence> void compile_branch(unsigned r, bool live);
+	template <Precedence> std::shared_ptr<code> compile_body(args_list&& args);
+	void compile_for(unsigned r);
+	void compile_func(unsigned r);
+	void compile_obj(unsigned r);
+	void tail_calls(code& body);
+	void bind(code& code);
+
+	static constexpr size_t npos = size_t(-1);		// no instruction or source position
+	size_t emit(opcode op, unsigned a = 0, unsigned b = 0, apply_fn fn = nullptr, size_t pos = npos);
+	void label(size_t jump)		{ _code->program[jump].b = unsigned(_code->program.size()); _label = _code->program.size(); }
+	unsigned constant(value_t value);
+	unsigned name(symbol name);
+	unsigned member(symbol name);
+
+	// Constant folding
+	struct known_value {
+		value_t		value;
+		size_t		start;		// first instruction of the code computing the value
+	};
+	const known_value* known(unsigned r) const;
+	void track(const instruction& i);
+	void discard(size_t from);
+	bool fold(unsigned a, unsigned b, apply_fn fn, bool unary, size_t pos);
+	void assume(size_t from);
+	void dump(size_t from, string_view result);
+
+	parser&						_parser;
+	const compile_options		_options;
+	const backend				_backend;
+	code*						_code = nullptr;
+	size_t						_label = 0;
+	std::vector<std::optional<known_value>>	_known;		// registers holding constants
+	context::var_names			_shadowed;				// arguments, local and assigned variables that may hide built-ins
+	context::var_names			_assumed;				// built-ins whose values were folded
+};
+
+// Register machine executing compiled code within given context
+class vm
+{
+public:
+	vm(context& ctx) : _context(ctx) {}
+	value_t run(const code& code);
+	size_t position() const		{ return _position; }
+	static void member(value_t& target, const member_site& site);
+private:
+	void execute(frame& f);
+	context&	_context;
+	size_t		_position = 0;
+};
+
+}
@@ -1,33 +1,49 @@
 #pragma once
 
 #include "nscript3.h"
+#include "ncompiler.h"
 
 namespace nscript3 {
 
 class object;
 
 i_object *get_obj(const value_t& v) {
-	if(auto po = std::get_if<object_ptr>(&v); po && po->get()) return po->get();
+	if(auto po = get_if<object_ptr>(&v); po && po->get()) return po->get();
 	throw std::system_error(errc::type_mismatch, "hash");
 }
 
+// Value that dereferences to itself, so it is read out of container as is rather than through indexer
+bool is_plain(const value_t& v) {
+	auto po = get_if<object_ptr>(&v);
+	if(!po || !*po)	return true;
+	auto kind = (*po)->kind;
+	return kind == object_kind::hash || kind == object_kind::function || kind == object_kind::builtin || kind == object_kind::instance;
+}
+
 // Class that represents arrays
-class v_array : public object {
-	std::vector<value_t>	_items;
+class v_array final : public object {
+	params_t				_items;
 public:
-	v_array() {}
-	template<class InputIt> v_array(InputIt first, InputIt last) : _items(first, last) {}
-	v_array(std::initializer_list<value_t> items) : _items(items) {}
+	static constexpr object_kind kind_id = object_kind::array;
+	v_array() : object(kind_id) {}
+	template<class InputIt> v_array(InputIt first, InputIt last) : object(kind_id), _items(first, last) {}
+	v_array(std::initializer_list<value_t> items) : object(kind_id), _items(items) {}
 	value_t get() {
 		if(_items.empty())		return value_t{};
 		if(_items.size() == 1)	return _items.front();
-		return shared_from_this();
+		return object_ptr(this);
 	}
-	value_t index(value_t index) {
-		if(auto pi = std::get_if<double>(&index)) {
-			if(_items.size() < size_t(*pi))	_items.resize((size_t)*pi);
-			return std::make_shared<indexer>(std::static_pointer_cast<v_array>(shared_from_this()), (size_t)*pi);
-		}
+	value_t index(value_t index)	{ return make_ref<indexer>(array_ptr(this), position(index)); }
+	// element for reading, the array does not grow
+	value_t at(const value_t& index) {
+		auto i = position(index);
+		if(i >= _items.size())	throw std::system_error(std::make_error_code(std::errc::invalid_argument), "'index'");
+		return is_plain(_items[i]) ? _items[i] : make_ref<indexer>(array_ptr(this), i);
+	}
+	// negative and NaN indexes are errors rather than wrapping around to huge positions
+	static size_t position(const value_t& index) {
+		if(auto pi = get_if<int64_t>(&index); pi && *pi >= 0)					return size_t(*pi);
+		if(auto pd = get_if<double>(&index); pd && *pd >= 0 && *pd < 0x1p63)	return size_t(*pd);
 		throw std::system_error(std::make_error_code(std::errc::invalid_argument), "'index'");
 	}
 	string_t print() const {
@@ -41,116 +57,197 @@ public:
 		ss << ']';
 		return ss.str();
 	}
-	std::vector<value_t>& items() { return _items; }
+	params_t& items() { return _items; }
+	void parts(const value_visitor& visit) const	{ for(auto& v : _items) visit(v); }
 
-protected:
-	class indexer : public object {
+	class indexer final : public object {
 		value_t& entry(bool resize = false) { 
 			if(_data->items().size() <= size_t(_index)) {
-				if(resize)	_data->items().resize(_index + 1);
+				if(resize && _index < _data->items().max_size())	_data->items().resize(_index + 1);
 				else		throw std::system_error(std::make_error_code(std::errc::invalid_argument), "'index'");
 			}
 			return _data->items()[_index];
 		}
-		std::shared_ptr<v_array>	_data;
-		int							_index;
+		array_ptr	_data;
+		size_t						_index;
 	public:
-		indexer(std::shared_ptr<v_array> arr, int index) : _index(index), _data(arr) {};
+		static constexpr object_kind kind_id = object_kind::array_item;
+		indexer(array_ptr arr, size_t index) : object(kind_id), _index(index), _data(arr) {};
 		value_t get()					{ return entry(); }
 		void set(value_t value)			{ entry(true) = value; }
 		value_t call(value_t params)	{ return get_obj(entry())->call(params); }
-		value_t item(string_t item)		{ return get_obj(entry())->item(item); }
+		value_t item(symbol item)		{ return get_obj(entry())->item(item); }
 		value_t index(value_t index)	{ return get_obj(entry())->index(index); }
+		void parts(const value_visitor& visit) const	{ visit(_data); }
 	};
 };
 
 // Class that represents script variables
-class variable : public object {
+class variable final : public object {
 	value_t			_value;
 public:
-	variable() : _value() {}
+	static constexpr object_kind kind_id = object_kind::variable;
+	variable() : object(kind_id), _value() {}
 	value_t get() { return _value; }
 	void set(value_t value) { _value = value; }
 	value_t create() const		 { return get_obj(_value)->create(); }
 	value_t call(value_t params) { return get_obj(_value)->call(params); }
-	value_t item(string_t item)  { return get_obj(_value)->item(item); }
+	value_t item(symbol item)  { return get_obj(_value)->item(item); }
+	const value_t& value() const { return _value; }
+	value_t& value()			 { return _value; }
 	value_t index(value_t index) {
-		if(auto pobj = std::get_if<object_ptr>(&_value); pobj && pobj->get())	return (*pobj)->index(index);
+		if(auto pobj = get_if<object_ptr>(&_value); pobj && pobj->get())	return (*pobj)->index(index);
 		auto a = to_array(_value);
 		_value = a;
 		return a->index(index);
 	}
+	value_t at(const value_t& index) {
+		auto pobj = get_if<object_ptr>(&_value);
+		if(!pobj || !pobj->get())			return to_array(_value)->at(index);
+		if(auto a = object_cast<v_array>(*pobj))	return a->at(index);
+		return (*pobj)->at(index);
+	}
 	string_t print() const { return get_obj(_value)->print(); }
+	void parts(const value_visitor& visit) const	{ visit(_value); }
 };
 
-// Built-in functions
-template<class FN> class builtin_function : public object {
+// Built-in functions, checking arguments once for all function types
+class builtin : public object {
 public:
-	builtin_function(int count, FN func) : _count(count), _func(func) {}
-	value_t call(value_t params) {
+	static constexpr object_kind kind_id = object_kind::builtin;
+	value_t call(value_t params) final {
 		if(auto pa = to_array_if(params); pa) {
 			if(_count >= 0 && _count != pa->size())	throw std::system_error(errc::bad_param_count, "'fn'");
-			return _func(*pa);
+			return _invoke(*this, *pa);
 		} 
-		else if(is_empty(params) && _count <= 0)	return _func({});
-		else if(_count < 0 || _count == 1)			return _func({ params });
+		else if(is_empty(params) && _count <= 0)	return _invoke(*this, {});
+		else if(_count < 0 || _count == 1)			return _invoke(*this, { params });
 		else										throw std::system_error(errc::bad_param_count, "'fn'");
 	}
 protected:
+	using invoke_fn = value_t(*)(builtin& self, const params_t& args);
+	builtin(int count, invoke_fn invoke) : object(kind_id), _count(count), _invoke(invoke) {}
 	const int			_count;
+	const invoke_fn		_invoke;
+};
+template<class FN> class builtin_function final : public builtin {
+public:
+	builtin_function(int count, FN func) : builtin(count, &invoke), _func(func) {}
+private:
+	static value_t invoke(builtin& self, const params_t& args) { return static_cast<builtin_function&>(self)._func(args); }
 	FN					_func;
 };
-template<class FN> object_ptr make_fn(int count, FN fn) { return std::make_shared<builtin_function<FN>>(count, fn); }
+template<class FN> object_ptr make_fn(int count, FN fn) { return make_ref<builtin_function<FN>>(count, fn); }
 
 // User-defined functions
-void process_args(const args_list& args, const value_t& params, nscript& script) {
+void process_args(const args_list& args, const value_t& params, context& ctx) {
 	if(args.size() == 0) {
-		script.add("@", params);
+		static const symbol all("@");
+		ctx.set(all, params);
 	} else if(args.size() == 1 && is_empty(params))	{
-		script.add(args.front(), params);
+		ctx.set(args.front(), params);
 	} else {
 		auto a = to_array(params);
 		if(args.size() != a->items().size())	throw std::system_error(errc::bad_param_count, "args");
-		for(int i = (int)args.size() - 1; i >= 0; i--)	script.add(args[i], a->items()[i]);
+		for(int i = (int)args.size() - 1; i >= 0; i--)	ctx.set(args[i], a->items()[i]);
 	}
 }
 
-class user_function	: public object {
-	const args_list		_args;
-	const string_t		_body;
+class user_function final : public object {
+	friend class vm;
+	const code_ptr		_code;
 	const context		_context;
 public:
-	user_function(const args_list& args, string_view body, const context *pcontext = nullptr, const context::var_names* pcaptures = nullptr) 
-		: _args(args), _body(body), _context(pcontext, pcaptures)	{}
+	static constexpr object_kind kind_id = object_kind::function;
+	user_function(code_ptr body, const context *pcontext)
+		: object(kind_id), _code(body), _context(pcontext, &body->captures)	{}
 	value_t call(value_t params) {
-		nscript script(_body, &_context);
-		process_args(_args, params, script);
-		value_t res;
-		script.parse<nscript::Script>(res, false);
-		return res;
+		context ctx(&_context);
+		process_args(_code->args, params, ctx);
+		return vm(ctx).run(*_code);
 	}
+	void parts(const value_visitor& visit) const	{ _context.parts(visit); }
+};
+
+// Member layout of user class instances, identified for inline caches by unique id
+class shape {
+	static inline std::atomic<unsigned>	s_ids = 0;
+public:
+	static constexpr unsigned npos = unsigned(-1);		// name is not a member
+	shape(std::vector<symbol>&& names) : id(++s_ids), names(std::move(names)) {}
+	unsigned find(symbol name) const {
+		auto p = std::lower_bound(names.begin(), names.end(), name);
+		return p != names.end() && *p == name ? unsigned(p - names.begin()) : npos;
+	}
+	const unsigned					id;
+	const std::vector<symbol>		names;		// sorted
+};
+using shape_ptr = std::shared_ptr<const shape>;
+
+// Layouts of instances created so far, common to a class and its copies bound to arguments
+struct shapes_t {
+	std::mutex					lock;
+	std::vector<shape_ptr>		list;
 };
 
 // User-defined classes
 class user_class : public object {
-	const args_list		_args;
-	const string_t		_body;
+	const code_ptr		_code;
 	const context		_context;
 	value_t				_params;
+	const std::shared_ptr<shapes_t>	_shapes;
 public:
-	user_class(const args_list& args, string_view body, const context *pcontext = nullptr, const context::var_names* pcaptures = nullptr)
-		: _args(args), _body(body), _context(pcontext, pcaptures) {}
-	value_t create() const			{ return std::make_shared<instance>(_body, &_context, _args, _params); }
-	value_t call(value_t params)	{ _params = params; return shared_from_this(); }
+	user_class(code_ptr body, const context *pcontext)
+		: _code(body), _context(pcontext, &body->captures), _shapes(std::make_shared<shapes_t>()) {}
+	user_class(const user_class& cls, value_t params)
+		: _code(cls._code), _context(cls._context), _params(params), _shapes(cls._shapes) {}
+	value_t create() const			{ return make_ref<instance>(_code, &_context, _params, *_shapes); }
+	// arguments of 'new' are kept by the class, or by a copy if other threads may use the class meanwhile
+	value_t call(value_t params) {
+		if(!is_local())	return make_ref<user_class>(*this, params);
+		_params = params;
+		return object_ptr(this);
+	}
+	void parts(const value_visitor& visit) const	{ _context.parts(visit); visit(_params); }
 
-	class instance : public object {
-		nscript				_script;
+	class instance final : public object {
+		nscript					_script;
+		shape_ptr				_shape;
+		std::vector<value_t*>	_members;		// variables of the instance in order of shape names
+		static value_t value(const value_t& v) {
+			auto po = get_if<object_ptr>(&v);
+			return po && *po ? (*po)->get() : v;
+		}
 	public:
-		instance(string_view body, const context *pcontext, const args_list& args, value_t params) : _script(body, pcontext) {
-			process_args(args, params, _script);
-			_script.parse<nscript::Script>(value_t{}, false);
+		static constexpr object_kind kind_id = object_kind::instance;
+		instance(const code_ptr& code, const context *pcontext, value_t params, shapes_t& shapes) : object(kind_id), _script({}, pcontext) {
+			process_args(code->args, params, _script._context);
+			vm(_script._context).run(*code);
+			// members are fixed once the body has run, share the layout with other instances having the same members
+			auto& vars = _script._context._locals.front().vars;
+			std::vector<symbol> names;
+			for(auto& v : vars)	names.push_back(v.first);
+			std::sort(names.begin(), names.end());
+			std::lock_guard lock(shapes.lock);
+			auto p = std::find_if(shapes.list.begin(), shapes.list.end(), [&](auto& s) { return s->names == names; });
+			_shape = p != shapes.list.end() ? *p : shapes.list.emplace_back(std::make_shared<shape>(std::move(names)));
+			for(auto& name : _shape->names)	_members.push_back(&vars.at(name));
+		}
+		void parts(const value_visitor& visit) const	{ _script._context.parts(visit); }
+		value_t item(symbol item)	{
+			if(auto slot = _shape->find(item); slot != shape::npos)	return value(*_members[slot]);
+			if(auto p = context::_globals.find(item); p != context::_globals.end())	return value(p->second);
+			return value_t{};
+		}
+		// member lookup through inline cache of the access site
+		value_t member(const member_site& site) {
+			auto cached = site.cache.load(std::memory_order_relaxed);
+			if(unsigned(cached >> 32) == _shape->id)	return value(*_members[unsigned(cached)]);
+			auto slot = _shape->find(site.name);
+			if(slot == shape::npos)	return item(site.name);
+			site.cache.store(uint64_t(_shape->id) << 32 | slot, std::memory_order_relaxed);
+			return value(*_members[slot]);
 		}
-		value_t item(string_t item)	{ return std::get<value_t>(_script.eval(item)); }
 	};
 };
 
@@ -159,13 +256,14 @@ class fold_function : public object
 {
 	object_ptr	_fun;
 public:
+	void parts(const value_visitor& visit) const	{ visit(_fun); }
 	fold_function(object_ptr fun) : _fun(fun) {}
 	value_t call(value_t params) {
 		auto src = to_array(params);
 		if(src->items().empty())	return value_t{};
 		value_t result = src->items().front();
 		for(unsigned i = 1; i < src->items().size(); i++) {
-			result = _fun->call(std::make_shared<v_array>(std::initializer_list<value_t>{ result, src->items()[i] }));
+			result = _fun->call(make_ref<v_array>(std::initializer_list<value_t>{ result, src->items()[i] }));
 		}
 		return result;
 	}
@@ -175,10 +273,11 @@ class map_function : public object
 {
 	object_ptr	_fun;
 public:
+	void parts(const value_visitor& visit) const	{ visit(_fun); }
 	map_function(object_ptr fun) : _fun(fun) {}
 	value_t call(value_t params) {
 		auto src = to_array(params);
-		auto dst = std::make_shared<v_array>();
+		auto dst = make_ref<v_array>();
 		for(auto& i : src->items()) {
 			dst->items().push_back(_fun->call(i));
 		}
@@ -190,10 +289,11 @@ class filter_function : public object
 {
 	object_ptr	_fun;
 public:
+	void parts(const value_visitor& visit) const	{ visit(_fun); }
 	filter_function(object_ptr fun) : _fun(fun) {}
 	value_t call(value_t params) {
 		auto src = to_array(params);
-		auto dst = std::make_shared<v_array>();
+		auto dst = make_ref<v_array>();
 		for(auto& i : src->items()) {
 			if(to_bool(_fun->call(i)))	dst->items().push_back(i);
 		}
@@ -202,13 +302,22 @@ public:
 };
 
 // Class that represents arrays
-class assoc_array : public object {
-	std::unordered_map<string_t, value_t>	_items;
+// Keys come from data, so they are kept as strings rather than interned as symbols, which live until the process ends
+class assoc_array final : public object {
+	using items_t = std::unordered_map<string_t, value_t, std::hash<string_t>, std::equal_to<string_t>, arena_allocator<std::pair<const string_t, value_t>>>;
+	items_t				_items;
 public:
-	assoc_array() {}
-	value_t create() const		{ return std::make_shared<assoc_array>(); }
-	value_t index(value_t index){ return std::make_shared<indexer>(std::static_pointer_cast<assoc_array>(shared_from_this()), to_string(index)); }
-	value_t item(string_t item)	{ return std::make_shared<indexer>(std::static_pointer_cast<assoc_array>(shared_from_this()), item); }
+	static constexpr object_kind kind_id = object_kind::hash;
+	assoc_array() : object(kind_id) {}
+	value_t create() const		{ return make_ref<assoc_array>(); }
+	value_t index(value_t index){ return make_ref<indexer>(ref_ptr<assoc_array>(this), to_string(index)); }
+	value_t at(const value_t& index) {
+		auto key = to_string(index);
+		auto p = _items.find(key);
+		if(p == _items.end())	return value_t{};
+		return is_plain(p->second) ? p->second : make_ref<indexer>(ref_ptr<assoc_array>(this), std::move(key));
+	}
+	value_t item(symbol item)	{ return make_ref<indexer>(ref_ptr<assoc_array>(this), item.str()); }
 	string_t print() const {
 		std::stringstream ss;
 		ss << '[';
@@ -220,20 +329,24 @@ public:
 		ss << ']';
 		return ss.str();
 	}
-	std::unordered_map<string_t, value_t>& items() { return _items; }
+	items_t& items() { return _items; }
+	void parts(const value_visitor& visit) const	{ for(auto& item : _items) visit(item.second); }
 
-protected:
-	class indexer : public object {
-		value_t& entry()				{ return _data->items()[_index]; }
-		std::shared_ptr<assoc_array>	_data;
+	class indexer final : public object {
+		// keys are never removed, so the entry stays in place once found
+		value_t& entry()				{ if(!_entry) _entry = &_data->items()[_index]; return *_entry; }
+		ref_ptr<assoc_array>	_data;
 		string_t						_index;
+		value_t*						_entry = nullptr;
 	public:
-		indexer(std::shared_ptr<assoc_array> arr, string_t index) : _index(index), _data(arr) {};
+		static constexpr object_kind kind_id = object_kind::hash_item;
+		indexer(ref_ptr<assoc_array> arr, string_t index) : object(kind_id), _index(std::move(index)), _data(arr) {};
 		value_t get()					{ return entry(); }
 		void set(value_t value)			{ entry() = value; }
 		value_t call(value_t params)	{ return get_obj(entry())->call(params); }
-		value_t item(string_t item)		{ return get_obj(entry())->item(item); }
+		value_t item(symbol item)		{ return get_obj(entry())->item(item); }
 		value_t index(value_t index)	{ return get_obj(entry())->index(index); }
+		void parts(const value_visitor& visit) const	{ visit(_data); }
 	};
 };
 
@@ -13,65 +13,138 @@ struct op_base {
 	const parser::token token = parser::token::end;
 	const associativity assoc = associativity::left;
 	const dereference deref   = dereference::both;
-	template<class X, class Y> value_t operator()(X x, Y y) { throw std::system_error(std::make_error_code(std::errc::operation_not_supported), "op_base"); }
+	template<class X, class Y> value_t operator()(const X& x, const Y& y) { throw std::system_error(std::make_error_code(std::errc::operation_not_supported), "op_base"); }
+	// shortcut on boxed operands, taken before visit; operators passing a string through avoid copying it
+	static bool forward(value_t& x, const value_t& y) { return false; }
 };
 
 struct op_null : op_base { };
 
 #pragma region Conversion
 
-tm date2tm(std::chrono::system_clock::time_point date)
+// Dates are counted in days since 01.01.1970 in proleptic Gregorian calendar (algorithms of H. Hinnant)
+struct civil_date {
+	int64_t		year;
+	unsigned	month, day;
+};
+
+constexpr int64_t days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+	y -= m <= 2;
+	const int64_t era = (y >= 0 ? y : y - 399) / 400;
+	const unsigned yoe = unsigned(y - era * 400);
+	const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + int64_t(doe) - 719468;
+}
+
+constexpr civil_date civil_from_days(int64_t z)
+{
+	z += 719468;
+	const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+	const unsigned doe = unsigned(z - era * 146097);
+	const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	const unsigned mp = (5 * doy + 2) / 153;
+	const unsigned m = mp < 10 ? mp + 3 : mp - 9;
+	return { int64_t(yoe) + era * 400 + (m <= 2), m, doy - (153 * mp + 2) / 5 + 1 };
+}
+
+struct date_fields : civil_date {
+	unsigned	hour, minute, second;
+	unsigned	weekday;		// 0 for Sunday
+	unsigned	yearday;		// 0 for January 1st
+};
+
+date_fields split_date(date_t date)
+{
+	auto secs = date.time_since_epoch().count();
+	auto days = secs / 86400 - (secs % 86400 < 0);
+	auto time = unsigned(secs - days * 86400);
+	auto civil = civil_from_days(days);
+	return { civil, time / 3600, time / 60 % 60, time % 60, unsigned((days % 7 + 11) % 7), unsigned(days - days_from_civil(civil.year, 1, 1)) };
+}
+
+date_t make_date(int64_t year, unsigned month, unsigned day, unsigned hour = 0, unsigned minute = 0, unsigned second = 0)
+{
+	return date_t(std::chrono::seconds(days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second));
+}
+
+date_t local_now()
 {
-	auto t = std::chrono::system_clock::to_time_t(date);
+	auto t = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
 	tm tm = { 0 };
 	localtime_s(&tm, &t);
-	return tm;
+	return make_date(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
 }
 
-std::string to_string(value_t v)
+std::string to_string(const value_t& v)
 {
 	struct print_value {
 		string operator() (bool b) { return b ? "true" : "false"; }
+		string operator() (int64_t i) { return std::to_string(i); }
 		string operator() (double d) {
-			if(d - (int)d == 0.)	return std::to_string((int)d);
+			if(d == std::trunc(d) && fabs(d) < 0x1p63)	return std::to_string(int64_t(d));
 			std::stringstream ss;
 			ss << d;
 			return ss.str();
 		}
-		string operator() (string s) { return s; }
-		string operator() (nscript3::object_ptr o) {
+		string operator() (const string& s) { return s; }
+		string operator() (date_t d) {
+			static const char* const format[8] = { "", "", "%d:%02d" , "%d:%02d:%02d", "%02d.%02d.%04d", "%02d.%02d.%04d", "%02d.%02d.%04d %d:%02d", "%02d.%02d.%04d %d:%02d:%02d"};
+			auto f = split_date(d);
+			int is_date = !(f.day == 1 && f.month == 1 && f.year == 1970) ? 1 : 0;
+			int is_time = f.hour || f.minute || f.second ? 1 : 0;
+			int is_sec  = f.second ? 1 : 0;
+			char buf[32];
+			if(is_date)	sprintf_s(buf, format[is_date * 4 + is_time * 2 + is_sec], f.day, f.month, int(f.year), f.hour, f.minute, f.second);
+			else		sprintf_s(buf, format[is_time * 2 + is_sec], f.hour, f.minute, f.second);
+			return buf;
+		}
+		string operator() (const nscript3::object_ptr& o) {
 			if(o.get() == nullptr)	return "";
 			auto v = o->get();
-			if(auto po = std::get_if<object_ptr>(&v); *po != o)	return to_string(v);
+			if(auto po = get_if<object_ptr>(&v); *po != o)	return to_string(v);
 			return o->print();
 		}
 	};
 
-	return std::visit(print_value(), v);
+	return visit(print_value(), v);
 }
 
-bool to_bool(value_t v)
+bool to_bool(const value_t& v)
 {
 	struct to_bool_t {
 		bool operator() (bool i) { return i; }
 		bool operator() (double d) { return d != 0; }
-		bool operator() (string s) { return s == "true" || std::stoi(s) != 0; }
-		bool operator() (object_ptr o) { throw std::system_error(errc::type_mismatch, "to_bool"); }
+		bool operator() (int64_t i) { return i != 0; }
+		bool operator() (date_t d) { return d.time_since_epoch().count() != 0; }
+		bool operator() (const string& s) { return s == "true" || std::stoi(s) != 0; }
+		bool operator() (const object_ptr& o) { throw std::system_error(errc::type_mismatch, "to_bool"); }
 	};
-	return std::visit(to_bool_t(), v);
+	return visit(to_bool_t(), v);
 }
 
-double to_double(value_t v)
+double to_double(const value_t& v)
 {
 	struct to_double_t {
+		double operator() (bool b) { return b; }
 		double operator() (double d) { return d; }
-		double operator() (string s) { return std::stod(s); }
-		double operator() (object_ptr o) { throw std::system_error(errc::type_mismatch, "to_double"); }
+		double operator() (int64_t i) { return double(i); }
+		double operator() (date_t d) { return d.time_since_epoch().count() / 86400.; }		// days since 01.01.1970
+		double operator() (const string& s) { return std::stod(s); }
+		double operator() (const object_ptr& o) { throw std::system_error(errc::type_mismatch, "to_double"); }
 	};
-	return std::visit(to_double_t(), v);
+	return visit(to_double_t(), v);
+}
+
+int64_t to_int(const value_t& v)
+{
+	if(auto pi = get_if<int64_t>(&v); pi)	return *pi;
+	return int64_t(to_double(v));
 }
 
-tm to_date(const string& s)
+date_t to_date(const string& s)
 {
 	enum date_stage { day = 0, mon, year, hour, min, sec } stage = day;
 	int date[6] = { 0 };
@@ -97,20 +170,13 @@ tm to_date(const string& s)
 	if(date[3] < 0 || date[3] > 23)			throw std::system_error(errc::syntax_error, "to_date");
 	if(date[4] < 0 || date[4] > 59)			throw std::system_error(errc::syntax_error, "to_date");
 	if(date[5] < 0 || date[5] > 59)			throw std::system_error(errc::syntax_error, "to_date");
-	tm tm = { 0 };
-	tm.tm_isdst = -1;
-	tm.tm_mday = date[0];
-	tm.tm_mon = date[1] - 1;
-	tm.tm_year = date[2] - 1900;
-	tm.tm_hour = date[3];
-	tm.tm_min = date[4];
-	tm.tm_sec = date[5];
-	mktime(&tm);
-	return tm;
+	return make_date(date[2], date[1], date[0], date[3], date[4], date[5]);
 }
 
-tm to_date(value_t v)
+date_t to_date(const value_t& v)
 {
+	if(auto pd = get_if<date_t>(&v); pd)	return *pd;
+	if(auto ps = get_if<string>(&v); ps)	return to_date(*ps);
 	return to_date(to_string(v));
 }
 
@@ -122,47 +188,89 @@ struct op_add : op_base {
 	const parser::token token = parser::token::plus;
 	using op_base::operator();
 	value_t operator()(double x, double y)	{ return x + y; }
-	value_t operator()(string x, string y)	{ return x + y; }
-	value_t operator()(string x, double y)	{ return x + std::to_string(y); }
-	value_t operator()(double x, string y)	{ return std::to_string(x) + y; }
+	value_t operator()(int64_t x, int64_t y)	{ auto r = int64_t(uint64_t(x) + uint64_t(y)); return ((x ^ r) & (y ^ r)) < 0 ? value_t(double(x) + y) : value_t(r); }
+	value_t operator()(double x, int64_t y)	{ return x + y; }
+	value_t operator()(int64_t x, double y)	{ return x + y; }
+	value_t operator()(const string& x, const string& y)	{ return x + y; }
+	value_t operator()(const string& x, double y)	{ return x + std::to_string(y); }
+	value_t operator()(double x, const string& y)	{ return std::to_string(x) + y; }
+	value_t operator()(const string& x, int64_t y)	{ return x + std::to_string(y); }
+	value_t operator()(int64_t x, const string& y)	{ return std::to_string(x) + y; }
+	value_t operator()(date_t x, int64_t y)	{ return x + std::chrono::hours(24 * y); }			// days
+	value_t operator()(date_t x, double y)	{ return x + std::chrono::seconds(std::llround(y * 86400)); }
+	value_t operator()(int64_t x, date_t y)	{ return operator()(y, x); }
+	value_t operator()(double x, date_t y)	{ return operator()(y, x); }
+	value_t operator()(const string& x, date_t y)	{ return x + to_string(y); }
+	value_t operator()(date_t x, const string& y)	{ return to_string(x) + y; }
+
+	// x += y for string x, appended in place when x is not shared
+	static bool append(value_t& x, const string& y)	{ return x.append(y); }
+	static bool append(value_t& x, double y)		{ return x.type() == value_t::tag::string && x.append(std::to_string(y)); }
+	static bool append(value_t& x, int64_t y)		{ return x.type() == value_t::tag::string && x.append(std::to_string(y)); }
+	template<class Y> static bool append(value_t& x, const Y& y)	{ return false; }
 };
 
 struct op_sub : op_base {
 	const parser::token token = parser::token::minus;
 	using op_base::operator();
 	value_t operator()(double x, double y)	{ return { x - y }; }
+	value_t operator()(int64_t x, int64_t y)	{ auto r = int64_t(uint64_t(x) - uint64_t(y)); return ((x ^ y) & (x ^ r)) < 0 ? value_t(double(x) - y) : value_t(r); }
+	value_t operator()(double x, int64_t y)	{ return { x - y }; }
+	value_t operator()(int64_t x, double y)	{ return { x - y }; }
+	value_t operator()(date_t x, int64_t y)	{ return x - std::chrono::hours(24 * y); }
+	value_t operator()(date_t x, double y)	{ return x - std::chrono::seconds(std::llround(y * 86400)); }
+	value_t operator()(date_t x, date_t y)	{ auto s = (x - y).count(); return s % 86400 ? value_t(s / 86400.) : value_t(s / 86400); }	// days
 };
 
 struct op_neg : op_base {
 	const parser::token token = parser::token::minus;
 	const associativity assoc = associativity::right;
 	using op_base::operator();
-	template<class X> value_t operator()(X, double y) { return { -y }; }
-	template<class X> value_t operator()(X x, object_ptr y) { return std::visit([this, x](auto y) { return operator()(x, y); }, y->get()); }
+	template<class X> value_t operator()(const X&, double y) { return { -y }; }
+	template<class X> value_t operator()(const X&, int64_t y) { return y == INT64_MIN ? value_t(-double(y)) : value_t(-y); }
+	template<class X> value_t operator()(const X& x, const object_ptr& y) { return visit([&](const auto& y) { return operator()(x, y); }, y->get()); }
 };
 
 struct op_mul : op_base {
 	const parser::token token = parser::token::multiply;
 	using op_base::operator();
 	value_t operator()(double x, double y) { return { x * y }; }
+	value_t operator()(int64_t x, int64_t y) { auto d = double(x) * y; return fabs(d) < 0x1p62 ? value_t(x * y) : value_t(d); }	// double if result may overflow
+	value_t operator()(double x, int64_t y) { return { x * y }; }
+	value_t operator()(int64_t x, double y) { return { x * y }; }
 };
 
 struct op_div : op_base {
 	const parser::token token = parser::token::divide;
 	using op_base::operator();
 	value_t operator()(double x, double y) { return { x / y }; }
+	value_t operator()(int64_t x, int64_t y) {
+		if(y == 0 || (y == -1 && x == INT64_MIN) || x % y)	return double(x) / double(y);
+		return x / y;
+	}
+	value_t operator()(double x, int64_t y) { return { x / y }; }
+	value_t operator()(int64_t x, double y) { return { x / y }; }
 };
 
 struct op_mod : op_base	{
 	const parser::token token = parser::token::mod;
 	using op_base::operator();
 	value_t operator()(double x, double y) { return fmod( x, y); }
+	value_t operator()(int64_t x, int64_t y) { return y == 0 ? value_t(fmod(double(x), 0.)) : value_t(y == -1 ? 0 : x % y); }
+	value_t operator()(double x, int64_t y) { return fmod( x, double(y)); }
+	value_t operator()(int64_t x, double y) { return fmod( double(x), y); }
 };
 
 struct op_pow : op_base {
 	const parser::token token = parser::token::pwr;
 	using op_base::operator();
 	value_t operator()(double x, double y) { return { pow(x, y) }; }
+	value_t operator()(int64_t x, int64_t y) {
+		auto d = pow(double(x), double(y));
+		return y >= 0 && fabs(d) < 0x1p53 ? value_t(int64_t(d)) : value_t(d);
+	}
+	value_t operator()(double x, int64_t y) { return { pow(x, double(y)) }; }
+	value_t operator()(int64_t x, double y) { return { pow(double(x), y) }; }
 };
 
 #pragma endregion // +, -, *, /
@@ -172,14 +280,20 @@ struct op_pow : op_base {
 struct op_and : op_base {
 	const parser::token token = parser::token::and;
 	using op_base::operator();
-	value_t operator()(double x, double y) { return { double(int(x) & int(y)) }; }
+	value_t operator()(int64_t x, int64_t y) { return { x & y }; }
+	value_t operator()(double x, double y) { return { int64_t(x) & int64_t(y) }; }
+	value_t operator()(double x, int64_t y) { return { int64_t(x) & y }; }
+	value_t operator()(int64_t x, double y) { return { x & int64_t(y) }; }
 };
 
 struct op_or : op_base {
 	const parser::token token = parser::token::or;
 	using op_base::operator();
-	value_t operator()(double x, double y) { return { double(int(x) | int(y)) }; }
-	template<class X> value_t operator()(X x, object_ptr y) { 
+	value_t operator()(int64_t x, int64_t y) { return { x | y }; }
+	value_t operator()(double x, double y) { return { int64_t(x) | int64_t(y) }; }
+	value_t operator()(double x, int64_t y) { return { int64_t(x) | y }; }
+	value_t operator()(int64_t x, double y) { return { x | int64_t(y) }; }
+	template<class X> value_t operator()(const X& x, const object_ptr& y) { 
 		return y->call(x); 
 	}
 };
@@ -188,7 +302,8 @@ struct op_not : op_base {
 	const parser::token token = parser::token::not;
 	const associativity assoc = associativity::right;
 	using op_base::operator();
-	template<class X> value_t operator()(X, double y) { return double(~int(y)); }
+	template<class X> value_t operator()(const X&, double y) { return ~int64_t(y); }
+	template<class X> value_t operator()(const X&, int64_t y) { return ~y; }
 };
 
 #pragma endregion      // &, |, ~
@@ -198,49 +313,55 @@ struct op_not : op_base {
 struct comparator {
 	int operator() (bool b1, bool b2) { return !b1 && b2 ? -1 : b1 && !b2 ? 1 : 0; }
 	int operator() (double d1, double d2) { return d1 < d2 ? -1 : d1 > d2 ? 1 : 0; }
-	int operator() (string s1, string s2) { return s1.compare(s2); }
-	int operator() (object_ptr o1, object_ptr o2) {
+	int operator() (int64_t i1, int64_t i2) { return i1 < i2 ? -1 : i1 > i2 ? 1 : 0; }
+	int operator() (double d1, int64_t i2) { return operator()(d1, double(i2)); }
+	int operator() (int64_t i1, double d2) { return operator()(double(i1), d2); }
+	int operator() (date_t d1, date_t d2) { return d1 < d2 ? -1 : d1 > d2 ? 1 : 0; }
+	int operator() (date_t d1, const string& s2) { return operator()(d1, to_date(s2)); }
+	int operator() (const string& s1, date_t d2) { return operator()(to_date(s1), d2); }
+	int operator() (const string& s1, const string& s2) { return s1.compare(s2); }
+	int operator() (const object_ptr& o1, const object_ptr& o2) {
 		if(auto a1 = to_array_if(o1), a2 = to_array_if(o2); a1 && a2) {
-			if(a1->size() != a2->size())	return operator()((double)a1->size(), (double)a2->size());
+			if(a1->size() != a2->size())	return operator()(int64_t(a1->size()), int64_t(a2->size()));
 			auto[p1, p2] = std::mismatch(a1->begin(), a1->end(), a2->begin(), a2->end());
 			if(p1 == a1->end() || p2 == a2->end())	return 0;
-			return std::visit(*this, *p1, *p2);
+			return visit(*this, *p1, *p2);
 		}
-		return o1 < o2 ? -1 : o1 > o2 ? 1 : 0;
+		return o1 < o2 ? -1 : o2 < o1 ? 1 : 0;
 	}
-	template<class X> int operator()(X x, object_ptr y) { return -1; }
-	template<class Y> int operator()(object_ptr x, Y y) { return 1; }
-	template<class X, class Y> int operator()(X x, Y y) { throw std::system_error(errc::type_mismatch, "compare"); }
+	template<class X> int operator()(const X& x, const object_ptr& y) { return -1; }
+	template<class Y> int operator()(const object_ptr& x, const Y& y) { return 1; }
+	template<class X, class Y> int operator()(const X& x, const Y& y) { throw std::system_error(errc::type_mismatch, "compare"); }
 };
 
 struct op_gt : op_base {
 	const parser::token token = parser::token::gt;
-	template<class X, class Y> bool operator()(X x, Y y) { return comparator()(x, y) > 0; }
+	template<class X, class Y> bool operator()(const X& x, const Y& y) { return comparator()(x, y) > 0; }
 };
 
 struct op_lt : op_base {
 	const parser::token token = parser::token::lt;
-	template<class X, class Y> bool operator()(X x, Y y) { return comparator()(x, y) < 0; }
+	template<class X, class Y> bool operator()(const X& x, const Y& y) { return comparator()(x, y) < 0; }
 };
 
 struct op_ge : op_base {
 	const parser::token token = parser::token::ge;
-	template<class X, class Y> bool operator()(X x, Y y) { return comparator()(x, y) >= 0; }
+	template<class X, class Y> bool operator()(const X& x, const Y& y) { return comparator()(x, y) >= 0; }
 };
 
 struct op_le : op_base {
 	const parser::token token = parser::token::le;
-	template<class X, class Y> bool operator()(X x, Y y) { return comparator()(x, y) <= 0; }
+	template<class X, class Y> bool operator()(const X& x, const Y& y) { return comparator()(x, y) <= 0; }
 };
 
 struct op_eq : op_base {
 	const parser::token token = parser::token::equ;
-	template<class X, class Y> bool operator()(X x, Y y) { return comparator()(x, y) == 0; }
+	template<class X, class Y> bool operator()(const X& x, const Y& y) { return comparator()(x, y) == 0; }
 };
 
 struct op_ne : op_base {
 	const parser::token token = parser::token::nequ;
-	template<class X, class Y> bool operator()(X x, Y y) { return comparator()(x, y) != 0; }
+	template<class X, class Y> bool operator()(const X& x, const Y& y) { return comparator()(x, y) != 0; }
 };
 
 struct op_land : op_base {
@@ -259,7 +380,7 @@ struct op_lnot : op_base {
 	const parser::token token = parser::token::lnot;
 	const associativity assoc = associativity::right;
 	using op_base::operator();
-	template<class X> value_t operator()(X, bool y) { return !y; }
+	template<class X> value_t operator()(const X&, bool y) { return !y; }
 };
 
 struct op_if : op_base { const parser::token token = parser::token::ifop; };
@@ -273,28 +394,32 @@ struct op_xset : op_base {
 	const parser::token token = TOK;
 	const associativity assoc = associativity::right;
 	const dereference deref = dereference::right;
-	template<class X, class Y> value_t operator()(X x, Y y) { throw std::system_error(errc::missing_lval, "xset"); }
-	template<class Y> value_t operator()(object_ptr x, Y y) { 
-		auto v = std::visit([this, y](auto x) { return OP().operator()(x, y); }, x->get());
+	template<class X, class Y> value_t operator()(const X& x, const Y& y) { throw std::system_error(errc::missing_lval, "xset"); }
+	template<class Y> value_t operator()(const object_ptr& x, const Y& y) { 
+		if constexpr(TOK == parser::plusset)
+			if(auto var = object_cast<variable>(x); var && op_add::append(var->value(), y))	return var->get();
+		auto v = visit([&](const auto& x) { return OP().operator()(x, y); }, x->get());
 		return x->set(v), v; 
 	}
 };
 
 struct op_ppx : op_xset<op_add, parser::unaryplus>  { 
 	const dereference deref = dereference::none;
-	template<class X, class Y> value_t operator()(X x, Y y) { return op_xset::operator()(y, 1.); }
+	template<class X, class Y> value_t operator()(const X& x, const Y& y) { return op_xset::operator()(y, int64_t(1)); }
 };
 struct op_mmx : op_xset<op_sub, parser::unaryminus> { 
 	const dereference deref = dereference::none;
-	template<class X, class Y> value_t operator()(X x, Y y) { return op_xset::operator()(y, 1.); }
+	template<class X, class Y> value_t operator()(const X& x, const Y& y) { return op_xset::operator()(y, int64_t(1)); }
 };
 struct op_xpp : op_xset<op_add, parser::unaryplus>  { 
 	const associativity assoc = associativity::none;
-	template<class X, class Y> value_t operator()(X x, Y y) { auto v = *value_t{ x }; op_xset::operator()(x, 1.); return v; }
+	template<class X, class Y> value_t operator()(const X& x, const Y& y) { return op_xset::operator()(x, int64_t(1)); }
+	template<class Y> value_t operator()(const object_ptr& x, const Y&) { auto v = x->get(); op_xset::operator()(x, int64_t(1)); return v; }
 };
 struct op_xmm : op_xset<op_sub, parser::unaryminus> { 
 	const associativity assoc = associativity::none;
-	template<class X, class Y> value_t operator()(X x, Y y) { auto v = *value_t{ x }; op_xset::operator()(x, 1.); return v; }
+	template<class X, class Y> value_t operator()(const X& x, const Y& y) { return op_xset::operator()(x, int64_t(1)); }
+	template<class Y> value_t operator()(const object_ptr& x, const Y&) { auto v = x->get(); op_xset::operator()(x, int64_t(1)); return v; }
 };
 struct op_addset : op_xset<op_add, parser::plusset>	{ using op_xset::operator(); };
 struct op_subset : op_xset<op_sub, parser::minusset>{ using op_xset::operator(); };
@@ -309,43 +434,81 @@ struct op_assign : op_base {
 	const parser::token token = parser::token::assign;
 	const associativity assoc = associativity::right;
 	const dereference deref = dereference::right;
-	template<class Y> value_t operator()(object_ptr x, Y y)	{ x->set(y);  return {y}; }
-	value_t operator()(object_ptr x, object_ptr y)			{ auto v = y ? y->get() : y;  return x->set(v), v; }
+	template<class Y> value_t operator()(const object_ptr& x, const Y& y)	{ x->set(y);  return {y}; }
+	value_t operator()(const object_ptr& x, const object_ptr& y)			{ auto v = y ? y->get() : y;  return x->set(v), v; }
 	using op_base::operator();
+	static bool forward(value_t& x, const value_t& y) {
+		auto px = get_if<object_ptr>(&x);
+		if(!px || !*px || y.type() == value_t::tag::object)	return false;
+		if(auto var = object_cast<variable>(*px); var)	var->value() = y;
+		else											(*px)->set(y);
+		return x = y, true;
+	}
 };
 
 struct op_call : op_base	{
 	const parser::token token = parser::token::lpar;
 	const dereference deref = dereference::right;
-	template<class Y> value_t operator()(object_ptr x, Y y) { return x->call(y); }
+	template<class Y> value_t operator()(const object_ptr& x, const Y& y) { return get_obj(x)->call(y); }
 	using op_base::operator();
+	static bool forward(value_t& x, const value_t& y) { auto px = get_if<object_ptr>(&x); return px && *px && (x = call(px->get(), y), true); }
+	// functions held in variables are called directly, other objects through i_object
+	static value_t call(i_object* fn, const value_t& params) {
+		if(auto var = object_cast<variable>(fn); var)	fn = get_obj(var->value());
+		switch(fn->kind) {
+		case object_kind::function:	return static_cast<user_function*>(fn)->call(params);
+		case object_kind::builtin:	return static_cast<builtin*>(fn)->call(params);
+		default:					return fn->call(params);
+		}
+	}
 };
 
 struct op_index : op_base {
 	const parser::token token = parser::token::lsquare;
 	const dereference deref = dereference::right;
-	template<class Y> value_t operator()(object_ptr x, Y y) { return x->index(y); }
+	template<class Y> value_t operator()(const object_ptr& x, const Y& y) { return get_obj(x)->index(y); }
 	using op_base::operator();
+	static bool forward(value_t& x, const value_t& y) { auto px = get_if<object_ptr>(&x); return px && *px && (x = (*px)->index(y), true); }
+};
+
+// Index not assigned to, reads the element without making indexer
+struct op_at : op_index {
+	template<class Y> value_t operator()(const object_ptr& x, const Y& y) { return get_obj(x)->at(y); }
+	using op_base::operator();
+	static bool forward(value_t& x, const value_t& y) {
+		auto px = get_if<object_ptr>(&x);
+		if(!px || !*px)	return false;
+		auto obj = px->get();
+		switch(obj->kind) {
+		case object_kind::variable:	x = static_cast<variable*>(obj)->at(y); break;
+		case object_kind::array:	x = static_cast<v_array*>(obj)->at(y); break;
+		default:					x = obj->at(y);
+		}
+		return true;
+	}
 };
 
 struct op_item : op_base {
 	const parser::token token = parser::token::dot;
 	const dereference deref = dereference::right;
-	value_t operator()(object_ptr x, string_t y) { return x->item(y); }
+	value_t operator()(const object_ptr& x, const symbol& y) { return get_obj(x)->item(y); }
 	using op_base::operator();
+	// member name is not a value, so it is applied directly rather than through visit
+	static void apply(value_t& target, symbol name) { target = visit([&](const auto& x) { return op_item()(x, name); }, target); }
 };
 
 struct op_new : op_base {
 	const parser::token token = parser::token::newobj;
 	const dereference deref = dereference::none;
 	const associativity assoc = associativity::right;
-	template<class X> value_t operator()(X, object_ptr y) { return y->create(); }
+	template<class X> value_t operator()(const X&, const object_ptr& y) { return y->create(); }
 	using op_base::operator();
 };
 
 struct op_statmt : op_base	{
 	const parser::token token = parser::token::stmt;
-	template<class X, class Y> value_t operator()(X x, Y y)	{ return { y }; }
+	template<class X, class Y> value_t operator()(const X& x, const Y& y)	{ return { y }; }
+	static bool forward(value_t& x, const value_t& y)	{ return x = y, true; }
 };
 
 #pragma endregion      // ;, =, call, index, item, new
@@ -358,22 +521,24 @@ class composer : public object {
 public:
 	composer(object_ptr left, object_ptr right) : _left(left), _right(right) {}
 	value_t call(value_t params) { return _left->call(_right->call(params)); }
+	void parts(const value_visitor& visit) const	{ visit(_left); visit(_right); }
 };
 
 struct op_dot : op_base {
 	const parser::token token = parser::token::mdot;
 	using op_base::operator();
-	value_t operator()(object_ptr x, object_ptr y) { return std::make_shared<composer>(x, y); }
+	value_t operator()(const object_ptr& x, const object_ptr& y) { return make_ref<composer>(x, y); }
 };
 
 struct op_head : op_base {
 	const parser::token token = parser::token::apo;
 	const associativity assoc = associativity::right;
 	const dereference deref = dereference::right;
-	template<class X, class Y> value_t operator()(X, Y y) { return y; }
-	template<class X> value_t operator()(X, object_ptr y) { 
-		if(auto pa = std::dynamic_pointer_cast<v_array>(y); pa) 
-			return pa->items().empty() ? value_t{} : pa->items().front(); 
+	template<class X, class Y> value_t operator()(const X&, const Y& y) { return y; }
+	static bool forward(value_t& x, const value_t& y) { return y.type() != value_t::tag::object && (x = y, true); }
+	template<class X> value_t operator()(const X&, const object_ptr& y) { 
+		if(auto pa = to_array_if(y); pa) 
+			return pa->empty() ? value_t{} : pa->front(); 
 		throw std::system_error(std::make_error_code(std::errc::invalid_argument), "op_head");
 	}
 };
@@ -381,24 +546,24 @@ struct op_head : op_base {
 struct op_tail : op_base {
 	const parser::token token = parser::token::apo;
 	const associativity assoc = associativity::none;
-	template<class X, class Y> value_t operator()(X x, Y) { return value_t{}; }
-	template<class Y> value_t operator()(object_ptr x, Y) { 
-		if(auto pa = to_array_if(x); pa)	return pa->empty() ? value_t{} : std::make_shared<v_array>(pa->begin() + 1, pa->end()); 
+	template<class X, class Y> value_t operator()(const X& x, const Y&) { return value_t{}; }
+	template<class Y> value_t operator()(const object_ptr& x, const Y&) { 
+		if(auto pa = to_array_if(x); pa)	return pa->empty() ? value_t{} : make_ref<v_array>(pa->begin() + 1, pa->end()); 
 		throw std::system_error(std::make_error_code(std::errc::invalid_argument), "op_tail");
 	}
 };
 
 struct op_join : op_base {
 	const parser::token token = parser::token::colon;
-	template<class X, class Y> value_t operator()(X x, Y y) { 
+	template<class X, class Y> value_t operator()(const X& x, const Y& y) { 
 		if(is_empty(x))	return { y };
 		if(is_empty(y))	return { x };
 		if(auto ys = to_array_if({ y }); ys)
 			return ys->insert(ys->begin(), x), y;
 		else
-			return std::make_shared<v_array>(std::initializer_list<value_t>{x, y});
+			return make_ref<v_array>(std::initializer_list<value_t>{x, y});
 	}
-	template<class Y> value_t operator()(object_ptr x, Y y) {
+	template<class Y> value_t operator()(const object_ptr& x, const Y& y) {
 		if(x == nullptr)	return { y };
 		if(is_empty(y))		return { x };
 		if(auto xs = to_array_if(x); xs) {
@@ -411,7 +576,7 @@ struct op_join : op_base {
 			if(auto ys = to_array_if({ y }); ys)
 				return ys->insert(ys->begin(), x), y;
 			else
-				return std::make_shared<v_array>(std::initializer_list<value_t>{x, y});
+				return make_ref<v_array>(std::initializer_list<value_t>{x, y});
 		}
 	}
 };
@@ -38,9 +38,11 @@ public:
 		Assert::AreEqual("42", eval("42").c_str(), "integers", LINE_INFO());
 		Assert::AreEqual("-123456789", eval("-123456789").c_str(), "long int", LINE_INFO());
 		Assert::AreEqual("31", eval("0x1F").c_str(), "hex", LINE_INFO());
+		Assert::AreEqual("9223372036854775807", eval("0x7fffffffffffffff").c_str(), "int64", LINE_INFO());
 		Assert::AreEqual("3.14", eval("3.14").c_str(), "float", LINE_INFO());
 		Assert::AreEqual("-1.314", eval("-3.14e-1-1e+0").c_str(), "exp", LINE_INFO());
 		Assert::AreEqual("a\"b\"'c'", eval("'a\"b\"'+\"'c'\"").c_str(), "string", LINE_INFO());
+		Assert::AreEqual("a ab abc3", eval("s='a'; t=s; s+='b'; u=s; s+='c'; s+=3; t+' '+u+' '+s").c_str(), "append", LINE_INFO());
 		Assert::AreEqual("3", eval("a=3;a").c_str(), "variable", LINE_INFO());
 		//Assert::AreEqual("26.10.1974", eval("#26.10.74#").c_str(), "date", LINE_INFO());
 		Assert::AreEqual("[1; 2; 3]", eval("[1,2,3]").c_str(), "array", LINE_INFO());
@@ -50,12 +52,21 @@ public:
 		Assert::AreEqual("1", eval("1;;;").c_str());
 		Assert::AreEqual("1", eval("x=2; test = sub {x=1;}; test(); x").c_str());
 		Assert::AreEqual("2", eval("x=2; test = sub {my x; x=1;}; test(); x").c_str());
+		Assert::AreEqual("34", eval("r=0; x=1; for(i=0; i<3; i++) {r+=x; my x=10; r+=x}; r+x").c_str());
+		Assert::AreEqual("2", eval("y=0; { y+=1; { my y=10; y+=1 }; y+=1 }; y").c_str());
+		Assert::AreEqual("19", eval("x=1; for(i=0; i<2; i++) { y=x; { { my x=5; y+=x } }; x+=y }; x").c_str());
+		Assert::AreEqual("13", eval("y=0; for(i=0; i<6; i++) if(i%2) { y+=i; if(i>2) y+=1 else y-=1 } else y+=(i,1)[1]; y").c_str());
 		Assert::AreEqual("ok", eval("\
 				intr = sub(f,a,b,dx) {for(my s=0, my x=a;x<b;x+=dx) s+=f(x)*dx; s}; \
 				if(intr(sub(x) x^2, 0, 2, 0.0001)-2^3/3 < 0.01) 'ok' else 'fail'").c_str());
 	}
 	TEST_METHOD(Operators)
 	{
+		Assert::AreEqual("12000000000", eval("3000000000 * 4").c_str());
+		Assert::AreEqual("-9223372036854775808", eval("-9223372036854775807 - 1").c_str());
+		Assert::AreEqual("9.22337e+18", eval("9223372036854775807 + 1").c_str());
+		Assert::AreEqual("2.5 2 -1 1024 a1", eval("str(5/2) + ' ' + 4/2 + ' ' + -7%3 + ' ' + 2^10 + ' a' + 1").c_str());
+		Assert::AreEqual("1099511627775", eval("0xFFFFFFFFFF & ~0 | 0xF").c_str());
 		Assert::AreEqual("7.5", eval("3+4.5").c_str());
 		Assert::AreEqual("81", eval("3^(2*(5-3))").c_str());
 		Assert::AreEqual("-5", eval("x=1; y=x++; z=++x; y-z+-x").c_str());
@@ -64,7 +75,11 @@ public:
 		Assert::AreEqual("A3", eval("upper(hex(0xAA & ~0x0F | 0x3))").c_str());
 		Assert::AreEqual("ok", eval("(1>2 || 1>=2 || 1<=2 || 1<2) && !(3==4) && (3!=4) ? 'ok' : 'fail'").c_str());
 		Assert::AreEqual("fail", eval("(2<=1 || 1<1 || 1>1 || 1<1) && !(3==3) && (3!=3) ? 'ok' : 'fail'").c_str());
+		Assert::AreEqual("0", eval("n=0; f=fn() n+=1; 1>2 && f(); 1<2 || f(); n").c_str());
+		Assert::AreEqual("2", eval("n=0; t=fn() { n+=1; true }; t() && !t() && t() || false; n").c_str());
 		Assert::AreEqual("-0.5", eval("x=1; y=2; x+=y; y-=x; x*=y; x/=y; x-=1; y/=2.").c_str());
+		Assert::AreEqual("abc", eval("a='abc'; b=c=a; h=new hash; h[a]=b; a==b && b<'abd' && h['abc']==c ? h[c] : 'fail'").c_str());
+		Assert::AreEqual("[3; 5; 4]", eval("a=[1,2,3]; a[1]=5; a[2]+=1; a[0]++; ++(a[0]); b=a[1]; b=0; a").c_str());
 	}
 	TEST_METHOD(Functions)
 	{
@@ -86,6 +101,10 @@ public:
 		Assert::AreEqual("45", eval("second('13:15:45')").c_str());
 		Assert::AreEqual("5", eval("dayofweek('23.08.2013')").c_str());
 		Assert::AreEqual("235", eval("dayofyear('23.08.2013')").c_str());
+		Assert::AreEqual("29.02.2000", eval("date('28.02.2000') + 1").c_str());
+		Assert::AreEqual("2", eval("date('01.03.2000') - date('28.02.2000')").c_str());
+		Assert::AreEqual("01.01.2000 12:00", eval("date('1.1.2000') + 0.5").c_str());
+		Assert::AreEqual("true", eval("date('1.1.2000') == '01.01.2000' && date('1.1.2000') < now()").c_str());
 		// math
 		Assert::AreEqual("0", eval("pi()-atan2(1,1)*4").c_str());
 		Assert::AreEqual("0", eval("a=pi()/3;sin(a)/cos(a)-tan(a)").c_str());
@@ -110,6 +129,10 @@ public:
 		Assert::AreEqual("", eval("min()").c_str());
 		Assert::AreEqual("", eval("max()").c_str());
 		Assert::AreEqual("7F3F0F", eval("upper(hex(rgb(15,63,127)))").c_str());
+		// tail calls
+		Assert::AreEqual("100000", eval("count = fn(n, acc) n == 0 ? acc : count(n - 1, acc + 1); count(100000, 0)").c_str());
+		Assert::AreEqual("done", eval("f = fn(n) { my x = n; if(x > 0) f(x - 1) else 'done' }; f(100000)").c_str());
+		Assert::AreEqual("10", eval("walk = fn(l, s) if(l == []) s else walk(l`, s + `l); walk([1,2,3,4], 0)").c_str());
 
 	}
 	TEST_METHOD(Arrays)
@@ -120,11 +143,14 @@ public:
 		Assert::AreEqual("10", eval("a=[[1,2,[3,4]],[4,5,6]];a[0][1]=a[0][2][1]+a[1][2]").c_str());
 		Assert::AreEqual("bbb", eval("a=[];a=add(a,'aaa');a=add(a,'bbb');a=remove(a,0);a[0]").c_str());
 		Assert::AreEqual("3", eval("m=new hash; m['abc']=3; m['abc']").c_str());
+		Assert::AreEqual("5", eval("m=new hash; m.abc=3; m['ab'+'c']+=2; m.abc").c_str());
 		Assert::AreEqual("", eval("m=hash; mm=new m; mm[0]").c_str());
+		Assert::AreEqual("true", eval("a=[1,'x',[2,'y']]; a == [1,'x',[2,'y']] && a != [1,'x',[2,'z']]").c_str());
 	}
 	TEST_METHOD(Functional)
 	{
 		Assert::AreEqual("15", eval("sum = fold(fn(x,y) x+y); sum([4,5,6])").c_str());
+		Assert::AreEqual("12", eval("f = [abs, fn(x) x+1, fold(\\x,y x+y)]; g = f[1]; f[0](-2) + g(2) + f[2]([3,4])").c_str());
 		Assert::AreEqual("36", eval("fold(fn(x,y) x*y)(map(fn() @^2)([1,2,3]))").c_str());
 		Assert::AreEqual("35", eval(R"(
 				odds   = \x x%2==1; 
@@ -169,6 +195,154 @@ public:
 				dist = sub(p1, p2) {sqrt((p1.x-p2.x)^2 + (p1.y-p2.y)^2)};\
 				p1=new point(3,4); p2 = new point(3, -1);\
 				p1.length() + dist(p1,p2)").c_str());
+		Assert::AreEqual("44", eval("c = object(a) { if(a) b = 2; x = a*2 }; s = 0;\
+				for(i=0; i<4; i++) { o = new c(i % 2); s += o.x + (i % 2 ? o.b*10 : 0) + o.sin(0) }; s").c_str());
+		Assert::AreEqual("", eval("o = new object { x = 1 }; o.y").c_str());
+	}
+	TEST_METHOD(Compiled)
+	{
+		nscript3::nscript ns1, ns2;
+		auto script = ns1.compile("x * 2 + y");
+		Assert::IsTrue((bool)script);
+		ns1.add("x", 1.);
+		ns2.add("x", 10.);
+		ns1.add("y", 1.);
+		ns2.add("y", 0.5);
+		Assert::AreEqual("3", to_string(std::get<nscript3::value_t>(ns1.eval(script))).c_str());
+		Assert::AreEqual("20.5", to_string(std::get<nscript3::value_t>(ns2.eval(script))).c_str());
+		Assert::AreEqual("3", to_string(std::get<nscript3::value_t>(ns1.eval(script))).c_str());
+		ns1.set_backend(nscript3::backend::closure);
+		auto fib = ns1.compile("f = fn(n) n < 2 ? n : f(n-1) + f(n-2); f(x * 10)");
+		Assert::AreEqual("55", to_string(std::get<nscript3::value_t>(ns1.eval(fib))).c_str());
+		Assert::AreEqual("4", to_string(std::get<nscript3::value_t>(ns1.eval("(new object(a) { b = a * 2 }(x)).b + 2"))).c_str());
+		Assert::IsFalse((bool)ns1.compile("(1,2"));
+		Assert::AreEqual(make_error_code(nscript3::errc::missing_character), ns1.get_error_info().code);
+		// values kept by context outlive the eval and the thread that made them
+		ns2.add("h", std::get<nscript3::value_t>(ns2.eval("h = new hash; for(i=0; i<2000; i++) { t = [i, 'v' + i]; h[i % 7] = t }; h")));
+		string kept;
+		std::thread([&] { kept = to_string(std::get<nscript3::value_t>(ns2.eval("h[4][0] + h[4][1]"))); }).join();
+		Assert::AreEqual("1999v1999", kept.c_str());
+		// chunks emptied by earlier evaluations and engines are reused
+		nscript3::nscript ns3;
+		for(int i = 0; i < 3; i++)	Assert::AreEqual("4999", to_string(std::get<nscript3::value_t>(ns3.eval("h = new hash; for(i=0; i<5000; i++) h[i] = i; h[4999]"))).c_str());
+		for(int i = 0; i < 3; i++)	Assert::AreEqual("v19999", eval("a=[]; for(i=0;i<20000;i++) a[i]='v'+i; a[19999]").c_str());
+		// built-ins are read by engines on all threads
+		std::vector<string> sums(4);
+		std::vector<std::thread> threads;
+		for(auto& sum : sums)	threads.emplace_back([&sum] { nscript3::nscript ns; sum = to_string(std::get<nscript3::value_t>(ns.eval("s=0; for(i=0; i<1000; i++) s+=len(str(i)); s"))); });
+		for(auto& t : threads)	t.join();
+		for(auto& sum : sums)	Assert::AreEqual("2890", sum.c_str());
+		// shared values are shared with everything reachable from them: items, captured variables, classes
+		auto data = std::get<nscript3::value_t>(ns1.eval("['a' + 1, 'bb' + 2, 'ccc' + 3]"));
+		auto f = std::get<nscript3::value_t>(ns1.eval("k = 5; fn(x) x + k"));
+		auto cls = std::get<nscript3::value_t>(ns1.eval("object(n) { v = n * 2 }"));
+		data.share(), f.share(), cls.share();
+		threads.clear();
+		for(auto& sum : sums)	threads.emplace_back([&] {
+			nscript3::nscript ns;
+			ns.add("data", data), ns.add("f", f), ns.add("C", cls);
+			sum = to_string(std::get<nscript3::value_t>(ns.eval("s = 0; for(i=0; i<2000; i++) { t = data[i % 3]; s += len(t) + f(i) + (new C(i)).v }; s")));
+		});
+		for(auto& t : threads)	t.join();
+		for(auto& sum : sums)	Assert::AreEqual("6012999", sum.c_str());
+		// assigned built-ins are hidden by variables of the engine, hash is per engine
+		Assert::AreEqual("6", to_string(std::get<nscript3::value_t>(ns1.eval("hash['k'] = 1; sin = 5; sin + 1"))).c_str());
+		Assert::AreEqual("1", to_string(std::get<nscript3::value_t>(ns1.eval("hash['k'] + sin(0)"))).c_str());
+		Assert::AreEqual("true", to_string(std::get<nscript3::value_t>(ns2.eval("hash['k'] == empty && sin(0) == 0"))).c_str());
+	}
+	TEST_METHOD(Pool)
+	{
+		nscript3::engine_pool pool(2, [](nscript3::nscript& ns) { ns.add("base", 100); });
+		auto script = pool.checkout()->compile("fresh = hash['n'] == empty; hash['n'] = n; fresh ? base + n : -1");
+		std::vector<string> results(4);
+		std::vector<std::thread> threads;
+		for(size_t t = 0; t < results.size(); t++) threads.emplace_back([&, t] {
+			for(int i = 0; i < 100; i++) {
+				auto ns = pool.checkout();
+				ns->add("n", int(t));
+				results[t] += to_string(std::get<nscript3::value_t>(ns->eval(script)));
+			}
+		});
+		for(auto& t : threads)	t.join();
+		for(size_t t = 0; t < results.size(); t++) {
+			string expected;
+			for(int i = 0; i < 100; i++)	expected += std::to_string(100 + t);
+			Assert::AreEqual(expected.c_str(), results[t].c_str());
+		}
+		// returned engines keep what setup added, variables and hash items of requests are dropped
+		auto ns = pool.checkout();
+		Assert::AreEqual("true", to_string(std::get<nscript3::value_t>(ns->eval("base == 100 && hash['n'] == empty && n == empty"))).c_str());
+		auto stats = pool.get_stats();
+		Assert::AreEqual(size_t(2), stats.size);
+		Assert::AreEqual(size_t(1), stats.in_use);
+		Assert::AreEqual(uint64_t(402), stats.checkouts);
+		Assert::IsTrue(stats.peak <= 2 && stats.utilization > 0 && stats.utilization <= 1);
+		// hash items stored by setup are kept, changes of requests are dropped
+		nscript3::engine_pool limits(1, [](nscript3::nscript& ns) { ns.eval("hash['limit'] = 10"); });
+		for(int i = 0; i < 3; i++)
+			Assert::AreEqual("10", to_string(std::get<nscript3::value_t>(limits.checkout()->eval("l = hash['limit']; hash['limit'] = l + 1; hash['new'] = 1; l"))).c_str());
+		Assert::AreEqual("true", to_string(std::get<nscript3::value_t>(limits.checkout()->eval("hash['new'] == empty"))).c_str());
+	}
+	TEST_METHOD(Batch)
+	{
+		nscript3::nscript ns;
+		ns.add("k", 10);
+		nscript3::column n = std::vector<int64_t>(1000), x = std::vector<double>(1000), s = std::vector<string>(1000, "r");
+		for(int i = 0; i < 1000; i++)	std::get<std::vector<int64_t>>(n)[i] = i, std::get<std::vector<double>>(x)[i] = i / 2.;
+		nscript3::column out = std::vector<string>();
+		Assert::IsTrue(std::get<bool>(ns.eval_batch(ns.compile("n % 2 ? x * k : s + n"), { {"n", &n}, {"x", &x}, {"s", &s} }, out, 4)));
+		auto& results = std::get<std::vector<string>>(out);
+		Assert::AreEqual(size_t(1000), results.size());
+		Assert::AreEqual("r998", results[998].c_str());
+		Assert::AreEqual("4995", results[999].c_str());
+		nscript3::column sums = std::vector<double>();
+		ns.eval_batch(ns.compile("n + x"), { {"n", &n}, {"x", &x} }, sums);
+		Assert::AreEqual(1498.5, std::get<std::vector<double>>(sums)[999]);
+		nscript3::column bound = std::vector<int64_t>();
+		ns.eval_batch(ns.compile("abs == 3 ? 1 : 0"), { {"abs", &n} }, bound);
+		Assert::AreEqual(int64_t(1), std::get<std::vector<int64_t>>(bound)[3]);
+		// host values used by rows of all threads, hash used in order of rows
+		ns.add("names", std::get<nscript3::value_t>(ns.eval("['a' + 1, 'bb' + 2, 'ccc' + 3]")));
+		ns.add("f", std::get<nscript3::value_t>(ns.eval("m = 5; fn(x) x * m")));
+		nscript3::column used = std::vector<int64_t>();
+		ns.eval_batch(ns.compile("len(names[n % 3]) + f(n)"), { {"n", &n} }, used, 4);
+		Assert::AreEqual(int64_t(4 + 5 * 998), std::get<std::vector<int64_t>>(used)[998]);
+		ns.eval_batch(ns.compile("p = hash['prev']; hash['prev'] = n; p == empty ? -1 : p"), { {"n", &n} }, used, 4);
+		Assert::AreEqual(int64_t(-1), std::get<std::vector<int64_t>>(used)[0]);
+		Assert::AreEqual(int64_t(255), std::get<std::vector<int64_t>>(used)[256]);
+		ns.add("g", std::get<nscript3::value_t>(ns.eval("fn(x) { p = hash['last']; hash['last'] = x; p == empty ? -1 : p }")));
+		ns.eval_batch(ns.compile("g(n)"), { {"n", &n} }, used, 4);
+		Assert::AreEqual(int64_t(-1), std::get<std::vector<int64_t>>(used)[0]);
+		Assert::AreEqual(int64_t(255), std::get<std::vector<int64_t>>(used)[256]);
+		// error of the first failed row, input variables are gone after the batch
+		Assert::IsFalse(std::get<bool>(ns.eval_batch(ns.compile("n == 700 ? sin(n, n) : n"), { {"n", &n} }, out, 4)));
+		Assert::AreEqual(make_error_code(nscript3::errc::bad_param_count), ns.get_error_info().code);
+		Assert::AreEqual("true", to_string(std::get<nscript3::value_t>(ns.eval("n == empty && k == 10"))).c_str());
+	}
+	TEST_METHOD(Folding)
+	{
+		std::stringstream dump;
+		nscript3::nscript ns;
+		ns.set_options({ true, &dump });
+		Assert::AreEqual("b", to_string(std::get<nscript3::value_t>(ns.eval(ns.compile("if(0) 'a' else 2^3/2 > 3 ? 'b' : 'c'")))).c_str());
+		Assert::AreEqual("'a' => dropped\n2^3 => 8\n2^3/2 => 4\n2^3/2 > 3 => true\n'c' => dropped\n", dump.str().c_str());
+		dump.str({});
+		Assert::AreEqual("6", to_string(std::get<nscript3::value_t>(ns.eval(ns.compile("my int = fn(x) x * 2; int(3)")))).c_str());
+		Assert::AreEqual("", dump.str().c_str());
+		ns.set_options({ false, &dump });
+		Assert::AreEqual("4", to_string(std::get<nscript3::value_t>(ns.eval(ns.compile("2*2")))).c_str());
+		Assert::AreEqual("", dump.str().c_str());
+		// built-ins bound to other values by host are not taken for constants
+		ns.set_options({});
+		auto compiled = ns.compile("year == 2020 ? 'bound' : 'built-in'");
+		ns.add("year", 2020);
+		for(auto backend : { nscript3::backend::interpreter, nscript3::backend::bytecode, nscript3::backend::closure }) {
+			ns.set_backend(backend);
+			Assert::AreEqual("true", to_string(std::get<nscript3::value_t>(ns.eval("year == 2020"))).c_str());
+			Assert::AreEqual("true", to_string(std::get<nscript3::value_t>(ns.eval("f = fn() year == 2020 || false; f()"))).c_str());
+		}
+		Assert::AreEqual("bound", to_string(std::get<nscript3::value_t>(ns.eval(compiled))).c_str());
+		Assert::AreEqual("built-in", to_string(std::get<nscript3::value_t>(nscript3::nscript().eval(compiled))).c_str());
 	}
 	TEST_METHOD(Errors)
 	{
@@ -180,6 +354,7 @@ public:
 //		Assert::AreEqual(make_error_code(nscript3::errc::unknown_var), eval_hr("x+2"));
 		Assert::AreEqual(make_error_code(nscript3::errc::syntax_error), eval_hr("object(x) {"));
 		Assert::AreEqual(make_error_code(nscript3::errc::syntax_error), eval_hr("sub(x,$);"));
+		Assert::AreEqual(make_error_code(nscript3::errc::missing_character), eval_hr("if(0) 'abc else 1"));
 		Assert::AreEqual(make_error_code(std::errc::not_supported), eval_hr("(new object {})(0)"));
 		Assert::AreEqual(make_error_code(std::errc::not_supported), eval_hr("(new object {})=1"));
 		Assert::AreEqual(make_error_code(std::errc::not_supported), eval_hr("(new object {})[0]"));
@@ -188,9 +363,15 @@ public:
 		Assert::AreEqual(make_error_code(nscript3::errc::bad_param_count), eval_hr("sin(1,2)"));
 		Assert::AreEqual(make_error_code(std::errc::invalid_argument), eval_hr("x=1;;;;x[5]"));
 		Assert::AreEqual(make_error_code(std::errc::operation_not_supported), eval_hr("1[5]"));
+		Assert::AreEqual(make_error_code(nscript3::errc::missing_lval), eval_hr("5++"));
 		Assert::AreEqual(make_error_code(nscript3::errc::type_mismatch), eval_hr("(new hash)[0]()"));
 		Assert::AreEqual(make_error_code(nscript3::errc::type_mismatch), eval_hr("(new hash)[0].x"));
 		Assert::AreEqual(make_error_code(nscript3::errc::type_mismatch), eval_hr("(new hash)[0][0]"));
+		Assert::AreEqual(make_error_code(nscript3::errc::type_mismatch), eval_hr("empty[0]"));
+		Assert::AreEqual(make_error_code(std::errc::invalid_argument), eval_hr("a=[1,2];a[2]"));
+		Assert::AreEqual(make_error_code(std::errc::invalid_argument), eval_hr("a=[1,2];a[-1]=5"));
+		Assert::AreEqual(make_error_code(std::errc::invalid_argument), eval_hr("a=[1,2];a[-1]"));
+		Assert::AreEqual(make_error_code(std::errc::invalid_argument), eval_hr("a=[1,2];a[-0.5]=5"));
 		Assert::AreEqual(make_error_code(nscript3::errc::runtime_error), eval_hr("a=[];a[0x7fffffff]=1"));
 		Assert::AreEqual(make_error_code(nscript3::errc::syntax_error), eval_hr("1e2.3"));
 		Assert::AreEqual(make_error_code(nscript3::errc::syntax_error), eval_hr("1e2e3"));